@@ -1,303 +1,931 @@
-#include <DrawingWindow.h>
-#include <Utils.h>
-#include <SDL2/SDL_image.h>
-#include <fstream>
-#include <vector>
-#include <string>
-#include <sstream>
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <map>
-#include <array>
-#include <algorithm>
-#include <cmath>
-#include <sys/stat.h>
-#include <sys/types.h>
-
-#define WIDTH 640
-#define HEIGHT 480
+#include "renderer.h"
+#include <chrono>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/wait.h>
+#endif
+
+bool autoRotate = false;   // turn the model by 0.01 rad per interactive frame
+bool windowStale = false;  // the window was uncovered or resized: present the last frame again
+
+void handleEvent(SDL_Event event){
+    if(event.type==SDL_KEYDOWN){
+        switch(event.key.keysym.sym){
+            case SDLK_w: mainFrame.camera.scale *= 1.1f; break;
+            case SDLK_s: mainFrame.camera.scale /= 1.1f; break;
+            case SDLK_a: mainFrame.camera.panOffset.x -= 10.0f; break;
+            case SDLK_d: mainFrame.camera.panOffset.x += 10.0f; break;
+            case SDLK_q: mainFrame.camera.tiltOffset += 10.0f; break;
+            case SDLK_e: mainFrame.camera.tiltOffset -= 10.0f; break;
+            case SDLK_LEFT:  mainFrame.camera.orbitX -= 0.1f; break;
+            case SDLK_RIGHT: mainFrame.camera.orbitX += 0.1f; break;
+            case SDLK_UP:    mainFrame.camera.orbitY += 0.1f; break;
+            case SDLK_DOWN:  mainFrame.camera.orbitY -= 0.1f; break;
+            case SDLK_l:
+                shadingMode = ShadingMode((shadingMode+1)%SHADING_MODE_COUNT);
+                std::cout << "Shading: " << shadingModeNames[shadingMode] << "\n";
+                break;
+            case SDLK_r:
+                autoRotate = !autoRotate;
+                std::cout << (autoRotate ? "Auto-rotate on" : "Auto-rotate off") << "\n";
+                break;
+            case SDLK_m:
+                shadowMode = shadowMode==SHADOW_RAY ? SHADOW_MAP : SHADOW_RAY;
+                std::cout << (shadowMode==SHADOW_MAP ? "Shadow map" : "Ray-traced shadows") << "\n";
+                break;
+            case SDLK_p:
+                projection = projection==PROJECTION_ORTHO ? PROJECTION_PERSPECTIVE : PROJECTION_ORTHO;
+                std::cout << (projection==PROJECTION_PERSPECTIVE ? "Perspective camera" : "Orthographic camera") << "\n";
+                break;
+            case SDLK_f:
+                textureFilter = TextureFilter((textureFilter+1)%3);
+                std::cout << "Texture filter: " << textureFilterNames[textureFilter] << "\n";
+                break;
+            case SDLK_o:
+                profileOverlay = !profileOverlay;
+                std::cout << (profileOverlay ? "Profiler overlay on" : "Profiler overlay off") << "\n";
+                if(profileOverlay && profiledFrames) printProfile(std::cout, lastProfile, 1);
+                break;
+            case SDLK_g:
+                deferredShading = !deferredShading;
+                std::cout << (deferredShading ? "Deferred shading" : "Forward shading") << "\n";
+                break;
+            case SDLK_z:
+                hiZ = !hiZ;
+                std::cout << (hiZ ? "Hierarchical Z on" : "Hierarchical Z off") << "\n";
+                break;
+            case SDLK_c:
+                cullingEnabled = !cullingEnabled;
+                std::cout << (cullingEnabled ? "Culling on" : "Culling off") << ", last frame: ";
+                printCullCounts(std::cout,mainFrame,1);
+                break;
+            case SDLK_v:
+                lodEnabled = !lodEnabled;
+                std::cout << (lodEnabled ? "LOD selection on" : "LOD selection off") << "\n";
+                break;
+            case SDLK_t:
+                tiledRaster = !tiledRaster;
+                std::cout << (tiledRaster ? "Tiled rasterizer (" + std::to_string(rasterThreads) + " threads)" : std::string("Serial rasterizer")) << "\n";
+                break;
+            default:
+                return;
+        }
+        sceneRevision++;
+    }
+    else if(event.type==SDL_WINDOWEVENT &&
+            (event.window.event==SDL_WINDOWEVENT_EXPOSED || event.window.event==SDL_WINDOWEVENT_SIZE_CHANGED))
+        windowStale = true;
+}
 
 // ============================================================
-// ====================== FRAME SAVING =========================
+// ===================== HEADLESS BATCH ========================
 // ============================================================
 
-void ensureFramesFolder() {
-#if defined(_WIN32)
-    _mkdir("frames");
-#else
-    mkdir("frames", 0777);
-#endif
+// One camera path line per frame: "orbitX orbitY scale panX panY".
+// scale is relative to the fit-to-window scale from centerModel, so 1 frames
+// the whole model. Blank lines and lines starting with '#' are skipped.
+struct CameraKey {
+    float orbitX = 0.0f, orbitY = 0.0f;
+    float scale = 1.0f;
+    glm::vec2 pan{0.0f,0.0f};
+};
+
+std::vector<CameraKey> loadCameraPath(const std::string &filename){
+    std::vector<CameraKey> path;
+    std::ifstream file(filename);
+    if(!file.is_open()){ std::cerr << "Failed to open camera path: " << filename << std::endl; return path; }
+    std::string line;
+    while(std::getline(file,line)){
+        if(line.empty() || line[0]=='#') continue;
+        std::istringstream s(line); CameraKey k;
+        if(s>>k.orbitX>>k.orbitY>>k.scale>>k.pan.x>>k.pan.y) path.push_back(k);
+        else std::cerr << "Skipping bad camera line: " << line << std::endl;
+    }
+    return path;
+}
+
+bool loadHeadlessScene(const std::string &objPath,Model &model){
+    if(!(IMG_Init(IMG_INIT_PNG)&IMG_INIT_PNG)){
+        std::cerr<<"SDL_image Init Failed"<<std::endl;
+        return false;
+    }
+
+    std::string dir = objPath.substr(0, objPath.find_last_of("/\\")+1);
+    floorTexture = loadTexture(dir+"ground.png", false);
+    if(floorTexture<0)
+        std::cerr << "Continuing without floor texture" << std::endl;
+
+    model = loadModel(objPath);
+    centerModel(model,mainFrame);
+    return true;
 }
 
-void saveFramePNG(DrawingWindow &window, int frameNumber) {
-    std::string num = std::to_string(frameNumber);
-    num = std::string(5 - num.length(), '0') + num;  // zero pad
-    std::string filename = "frames/frame_" + num + ".png";
+// Renders frameCount frames straight into the in-memory framebuffer: no
+// window, no video subsystem and no 30 fps gate. Frames are numbered from
+// firstFrame, both for the camera and for the output files, so a frame
+// renders the same whichever run it belongs to. Without a camera path the
+// model turns by 0.01 rad per frame. With frameWorkers > 1 that many frames
+// are drawn at once, each on its own thread in its own FrameContext, and
+// handed to the sink in frame order; such frames are drawn single-threaded,
+// so whole frames rather than tiles are what runs in parallel.
+int runHeadless(const std::string &objPath,const std::string &cameraPath,int firstFrame,int frameCount,
+                const std::string &sinkFormat,const std::string &sinkOut,int frameWorkers){
+    Model model;
+    if(!loadHeadlessScene(objPath,model)) return -1;
+    const Framebuffer &fb = mainFrame.framebuffer;
+    float fitScale = mainFrame.camera.scale;
+
+    std::vector<CameraKey> path;
+    if(!cameraPath.empty()){
+        path = loadCameraPath(cameraPath);
+        if(path.empty()) return -1;
+        if(frameCount<0) frameCount = std::max(0, int(path.size())-firstFrame);
+    }
+    if(frameCount<0) frameCount = std::max(0, 360-firstFrame);
+    int endFrame = firstFrame+frameCount;
+
+    auto cameraFor = [&](int frame){
+        CameraKey k;
+        if(!path.empty()) k = path[std::min<size_t>(frame, path.size()-1)];
+        else k.orbitX = 0.01f*frame;
+
+        Camera camera;
+        camera.orbitX = k.orbitX; camera.orbitY = k.orbitY;
+        camera.scale = fitScale*k.scale;
+        camera.panOffset = k.pan;
+        return camera;
+    };
+
+    frameSink = makeFrameSink(sinkFormat, sinkOut, fb.width, fb.height);
+    if(!frameSink) return -1;
+    long cullTotals[CULL_RESULT_COUNT] = {};
+    Uint64 start = SDL_GetPerformanceCounter();
 
-    SDL_Surface* surf = SDL_CreateRGBSurfaceWithFormat(
-        0, WIDTH, HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888
-    );
+    if(frameWorkers<=1){
+        for(int frame=firstFrame;frame<endFrame;frame++){
+            mainFrame.camera = cameraFor(frame);
+            draw(mainFrame,model);
+            for(int r=0;r<CULL_RESULT_COUNT;r++) cullTotals[r] += mainFrame.cullCounts[r];
+            frameSink->write(mainFrame.framebuffer, frame);
+            endProfileFrame(frame, mainFrame.framebuffer);
+        }
+    }
+    else{
+        // Every frame reads the same shadow BVH, cache or map, so they are
+        // brought up to date once here rather than raced for by the workers
+        updateShadows(model);
+
+        std::atomic<int> nextDraw{firstFrame};
+        int nextWrite = firstFrame;
+        std::mutex writeMutex;
+        std::condition_variable written;
+        auto worker = [&](FrameContext &fc){
+            frameWorker = true;
+            for(int frame; (frame = nextDraw++) < endFrame;){
+                fc.camera = cameraFor(frame);
+                draw(fc,model);
+
+                std::unique_lock<std::mutex> lock(writeMutex);
+                written.wait(lock, [&]{ return nextWrite==frame; });
+                for(int r=0;r<CULL_RESULT_COUNT;r++) cullTotals[r] += fc.cullCounts[r];
+                frameSink->write(fc.framebuffer, frame);
+                endProfileFrame(frame, fc.framebuffer);
+                nextWrite++;
+                written.notify_all();
+            }
+        };
 
-    uint32_t* pixels = (uint32_t*)surf->pixels;
+        std::vector<std::unique_ptr<FrameContext>> contexts;
+        std::vector<std::thread> threads;
+        for(int w=0;w<std::min(frameWorkers,frameCount);w++){
+            contexts.push_back(std::make_unique<FrameContext>());
+            contexts.back()->framebuffer.resize(fb.width, fb.height);
+            threads.emplace_back(worker, std::ref(*contexts.back()));
+        }
+        for(auto &t : threads) t.join();
+    }
+    frameSink->finish();
+    for(int r=0;r<CULL_RESULT_COUNT;r++) mainFrame.cullCounts[r] = cullTotals[r];
 
-    for (int y = 0; y < HEIGHT; y++)
-        for (int x = 0; x < WIDTH; x++)
-            pixels[y * WIDTH + x] = window.getPixelColour(x, y);
+    double seconds = double(SDL_GetPerformanceCounter()-start) / SDL_GetPerformanceFrequency();
+    std::clog << "Rendered " << frameCount << " frames in " << seconds << " s ("
+              << frameCount/seconds << " fps)\n";
+    printCullCounts(std::clog,mainFrame,frameCount);
+    if(profiledFrames) printProfile(std::clog,profileTotals,profiledFrames);
+    IMG_Quit();
+    if(frameSink->failed){
+        std::cerr << "Some frames could not be written" << std::endl;
+        return -1;
+    }
+    return 0;
+}
 
-    if (IMG_SavePNG(surf, filename.c_str()) != 0)
-        std::cerr << "Failed to save PNG: " << IMG_GetError() << "\n";
-    else
-        std::cout << "Saved " << filename << "\n";
+// Renders the same turntable with both shadow modes (no frame output) and
+// reports the cost of each. Flat shading has no shadows, so it is measured
+// as shadowed. The turntable moves neither the light nor the model, so each
+// mode is timed twice: rebuilding its shadow cache or map every frame, as
+// when the light or geometry moves, and in the steady state of a static
+// scene, after a first frame that built them.
+int benchShadows(const std::string &objPath,int frameCount){
+    Model model;
+    if(!loadHeadlessScene(objPath,model)) return -1;
+    if(frameCount<0) frameCount = 120;
+    if(shadingMode==SHADING_FLAT) shadingMode = SHADING_SHADOWED;
 
-    SDL_FreeSurface(surf);
+    int profileFrame = 0;
+    for(ShadowMode mode : {SHADOW_RAY, SHADOW_MAP}){
+        shadowMode = mode;
+        for(bool rebuild : {true, false}){
+            invalidateShadowCache();
+            shadowMap.valid = false;
+            mainFrame.camera.orbitX = 0.0f;
+            if(!rebuild){
+                draw(mainFrame,model);
+                endProfileFrame(profileFrame++,mainFrame.framebuffer);
+            }
+            Uint64 start = SDL_GetPerformanceCounter();
+            for(int frame=0;frame<frameCount;frame++){
+                if(rebuild){
+                    invalidateShadowCache();
+                    shadowMap.valid = false;
+                }
+                mainFrame.camera.orbitX = 0.01f*frame;
+                draw(mainFrame,model);
+                endProfileFrame(profileFrame++,mainFrame.framebuffer);
+            }
+            double ms = 1000.0*double(SDL_GetPerformanceCounter()-start) / SDL_GetPerformanceFrequency();
+            const char* label = mode==SHADOW_RAY ? (rebuild ? "ray, rebuilt:        " : "ray, cached:         ")
+                                                 : (rebuild ? "shadow map, rebuilt: " : "shadow map, cached:  ");
+            std::cout << label << ms/frameCount << " ms/frame over " << frameCount << " frames, "
+                      << model.faces.size() << " faces\n";
+        }
+    }
+    IMG_Quit();
+    return 0;
 }
 
 // ============================================================
-// ==================== YOUR ORIGINAL CODE =====================
+// ===================== SHARDED BATCH =========================
 // ============================================================
 
-struct Material {
-    glm::vec3 Kd{1.0f,1.0f,1.0f};
-    bool textured = false;
-};
+// --shards N makes this process a coordinator for a headless image-sequence
+// render: the frame range is cut into N contiguous shards and each shard is
+// rendered by a separate worker process (this executable again, with the
+// same scene, camera and render flags plus --first-frame/--frames). While
+// the workers run, the coordinator counts finished frame files for
+// progress, each shard from where the previous poll stopped. A shard whose worker fails or leaves frames missing is rerun
+// over its missing frames, up to --shard-retries times; at the end every
+// frame in the range is checked. Frame files only appear once complete
+// (see publishFrameFile), so a file that is there is a finished frame.
+// The coordinator loads the model once first, so the mesh cache (and its
+// LODs) is written before the workers start and each of them reads it
+// instead of parsing the OBJ again. Worker output goes to frames/shard_NN.log.
+#define SHARD_POLL_MS 500
 
-struct Model {
-    std::vector<glm::vec3> vertices;
-    std::vector<std::array<int,3>> faces;
-    std::vector<std::string> faceMaterials;
-    std::map<std::string,Material> materials;
-    std::map<int, std::array<glm::vec2,3>> faceUVs;
+struct Shard {
+    int begin, end;        // frame range [begin,end)
+    int attempts = 0;
+    bool complete = false;
 };
 
-float scale = 1.0f;
-glm::vec2 panOffset(0.0f,0.0f);
-float tiltOffset = 0.0f;
-float orbitX = 0.0f;
-float orbitY = 0.0f;
+// Arguments forwarded to every worker: everything on the command line
+// except the coordinator's own flags, the frame range and the profile and
+// trace outputs, which the workers would all write to the same file. The
+// workers share the coordinator's --threads between them, so N shards do
+// not each start a pool the size of the machine.
+std::vector<std::string> workerArguments(int argc,char *argv[],int shardCount){
+    std::vector<std::string> args;
+    for(int i=1;i<argc;i++){
+        std::string arg = argv[i];
+        if(arg=="--shards" || arg=="--shard-retries" || arg=="--first-frame" || arg=="--frames" ||
+           arg=="--profile" || arg=="--trace" || arg=="--threads"){ i++; continue; }
+        if(arg=="--headless") continue;
+        args.push_back(arg);
+    }
+    args.insert(args.end(), { "--headless", "--threads", std::to_string(std::max(1, rasterThreads/shardCount)) });
+    return args;
+}
 
-glm::vec3 lightPos(0.0f,6.4f,1.0f);
-float ambientLight = 0.2f;
+#if defined(_WIN32)
+// One argument quoted the way the C runtime splits a command line back up
+std::string quoteArgument(const std::string &arg){
+    if(!arg.empty() && arg.find_first_of(" \t\"")==std::string::npos) return arg;
+    std::string quoted = "\"";
+    size_t backslashes = 0;
+    for(char c : arg){
+        if(c=='\\'){ backslashes++; continue; }
+        quoted.append(c=='"' ? 2*backslashes+1 : backslashes, '\\');
+        backslashes = 0;
+        quoted += c;
+    }
+    quoted.append(2*backslashes, '\\');
+    return quoted + "\"";
+}
+#endif
 
-std::vector<float> zBuffer(WIDTH*HEIGHT, -1e10f);
+// Runs one worker to completion with stdout and stderr appended to logPath
+// and returns its exit status (-1 if it could not be started). Everything
+// about how a worker is started lives here, so running shards elsewhere
+// means replacing only this function.
+int runWorker(const std::string &program,const std::vector<std::string> &args,const std::string &logPath){
+#if defined(_WIN32)
+    std::string commandLine = quoteArgument(program);
+    for(const auto &a : args) commandLine += " " + quoteArgument(a);
 
-SDL_Surface* floorTexture = nullptr;
+    SECURITY_ATTRIBUTES inherit{ sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+    HANDLE log = CreateFileA(logPath.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ|FILE_SHARE_WRITE, &inherit,
+                             OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(log==INVALID_HANDLE_VALUE) return -1;
+    STARTUPINFOA startup{};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startup.hStdOutput = log;
+    startup.hStdError = log;
+    PROCESS_INFORMATION process;
+    BOOL started = CreateProcessA(nullptr, &commandLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr,
+                                  &startup, &process);
+    CloseHandle(log);
+    if(!started) return -1;
+    WaitForSingleObject(process.hProcess, INFINITE);
+    DWORD status = 0;
+    if(!GetExitCodeProcess(process.hProcess, &status)) status = DWORD(-1);
+    CloseHandle(process.hProcess);
+    CloseHandle(process.hThread);
+    return int(status);
+#else
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for(const auto &a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+    pid_t pid = fork();
+    if(pid<0) return -1;
+    if(pid==0){
+        int log = ::open(logPath.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0644);
+        if(log>=0){ dup2(log,STDOUT_FILENO); dup2(log,STDERR_FILENO); ::close(log); }
+        execvp(program.c_str(), argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    if(waitpid(pid,&status,0)!=pid) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
 
-bool loadTexture(const std::string &path){
-    floorTexture = IMG_Load(path.c_str());
-    if(!floorTexture){
-        std::cerr << "Failed to load texture: " << path << std::endl;
-        return false;
+// True when the frame's file is there and looks whole: the right magic for
+// its format and, for PNG, the closing IEND chunk, for PPM exactly one
+// width x height image
+bool frameComplete(int frame,bool png,int width,int height){
+    std::ifstream file(frameFileName(frame, png ? "png" : "ppm"), std::ios::binary|std::ios::ate);
+    if(!file.is_open()) return false;
+    std::streamoff size = file.tellg();
+    char magic[4] = {};
+    file.seekg(0);
+    if(!file.read(magic,4)) return false;
+    if(png){
+        // An empty IEND chunk (length, type, CRC) is the last 12 bytes of every PNG
+        const char iend[12] = { 0,0,0,0, 'I','E','N','D', '\xAE','\x42','\x60','\x82' };
+        char tail[12];
+        if(std::memcmp(magic,"\x89PNG",4)!=0 || size<8+12) return false;
+        file.seekg(size-12);
+        return file.read(tail,12) && std::memcmp(tail,iend,12)==0;
     }
-    SDL_Surface* converted = SDL_ConvertSurfaceFormat(floorTexture, SDL_PIXELFORMAT_RGBA32, 0);
-    SDL_FreeSurface(floorTexture);
-    floorTexture = converted;
-    return true;
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    return std::memcmp(magic,"P6\n",3)==0 && size==std::streamoff(header.size()+size_t(width)*height*3);
 }
 
-// ---------- load MTL ----------
-std::map<std::string,Material> loadMTL(const std::string &filename){
-    std::map<std::string,Material> materials;
-    std::ifstream file(filename);
-    if(!file.is_open()){ std::cerr << "Failed to open MTL: " << filename << std::endl; return materials; }
-    std::string line, currentMaterial;
-    while(std::getline(file,line)){
-        if(line.substr(0,6)=="newmtl"){ currentMaterial = line.substr(7); materials[currentMaterial] = Material{}; }
-        else if(line.substr(0,2)=="Kd"){
-            std::istringstream s(line.substr(3)); float r,g,b; s>>r>>g>>b;
-            materials[currentMaterial].Kd = glm::vec3(r,g,b);
+int runSharded(int argc,char *argv[],const std::string &objPath,const std::string &cameraPath,int firstFrame,
+               int frameCount,const std::string &sinkFormat,int shardCount,int retries){
+    if(sinkFormat!="png" && sinkFormat!="ppm"){
+        std::cerr << "--shards needs an image sequence sink (png or ppm), not " << sinkFormat << std::endl;
+        return -1;
+    }
+    bool png = sinkFormat=="png";
+    int width = mainFrame.framebuffer.width, height = mainFrame.framebuffer.height;
+    if(frameCount<0){
+        if(cameraPath.empty()) frameCount = 360;
+        else{
+            std::vector<CameraKey> path = loadCameraPath(cameraPath);
+            if(path.empty()) return -1;
+            frameCount = path.size();
         }
+        frameCount = std::max(0, frameCount-firstFrame);
     }
-    return materials;
-}
+    int endFrame = firstFrame+frameCount;
+    shardCount = std::max(1, std::min(shardCount, frameCount));
 
-// ---------- load OBJ ----------
-Model loadOBJ(const std::string &filename){
-    Model model;
-    std::ifstream file(filename);
-    if(!file.is_open()){ std::cerr << "Failed to open OBJ: " << filename << std::endl; exit(1); }
-    std::string line, currentMaterial;
+    // Old frames in the range would pass the final check without being rendered
+    ensureFolder("frames");
+    for(int frame=firstFrame;frame<endFrame;frame++){
+        std::string name = frameFileName(frame, sinkFormat);
+        std::remove(name.c_str());
+        std::remove((name+".part").c_str());
+    }
+
+    std::vector<Shard> shards;
+    for(int s=0;s<shardCount;s++){
+        Shard shard;
+        shard.begin = firstFrame + int(long(frameCount)*s/shardCount);
+        shard.end = firstFrame + int(long(frameCount)*(s+1)/shardCount);
+        shards.push_back(shard);
+    }
+
+    if(useMeshCache) loadModel(objPath);
+    std::vector<std::string> forwarded = workerArguments(argc,argv,shardCount);
+    std::atomic<int> shardsDone{0};
+    auto runShard = [&](int s){
+        Shard &shard = shards[s];
+        char logName[32];
+        std::snprintf(logName, sizeof(logName), "frames/shard_%02d.log", s);
+        std::remove(logName);
+
+        int from = shard.begin, to = shard.end;
+        while(true){
+            std::vector<std::string> args = forwarded;
+            args.insert(args.end(), { "--first-frame", std::to_string(from), "--frames", std::to_string(to-from) });
+            int status = runWorker(argv[0], args, logName);
+            shard.attempts++;
 
-    auto normalizeUV = [](float x,float z){
-        float u = (x+3.0f)/6.0f;
-        float v = (z+2.0f)/6.0f;
-        return glm::vec2(u,v);
+            std::vector<int> missing;
+            for(int frame=from;frame<to;frame++)
+                if(!frameComplete(frame,png,width,height)) missing.push_back(frame);
+            if(missing.empty()){ shard.complete = true; break; }
+
+            std::string note = "Shard " + std::to_string(s) + " (frames " + std::to_string(shard.begin) + "-" +
+                               std::to_string(shard.end-1) + "): worker exited with " + std::to_string(status) + ", " +
+                               std::to_string(missing.size()) + " frames missing";
+            if(shard.attempts>retries){
+                std::clog << (note + ", giving up (see " + logName + ")\n");
+                break;
+            }
+            from = missing.front(); to = missing.back()+1;
+            std::clog << (note + ", retrying frames " + std::to_string(from) + "-" + std::to_string(to-1) + "\n");
+        }
+        shardsDone++;
     };
 
-    while(std::getline(file,line)){
-        if(line.substr(0,2)=="v "){
-            std::istringstream s(line.substr(2)); glm::vec3 v; s>>v.x>>v.y>>v.z;
-            model.vertices.push_back(v);
+    std::clog << "Rendering frames " << firstFrame << "-" << endFrame-1 << " in " << shardCount
+              << " worker processes\n";
+    Uint64 start = SDL_GetPerformanceCounter();
+    std::vector<std::thread> threads;
+    for(int s=0;s<shardCount;s++) threads.emplace_back(runShard, s);
+
+    // Progress counts each shard's finished frames from the first one not
+    // seen yet, so a poll only opens files that may have appeared since the
+    // last one rather than every file in the range
+    std::vector<int> seen;
+    for(const Shard &shard : shards) seen.push_back(shard.begin);
+    int reported = -1;
+    while(true){
+        bool finished = shardsDone==shardCount;
+        int rendered = 0;
+        for(int s=0;s<shardCount;s++){
+            while(seen[s]<shards[s].end && frameComplete(seen[s],png,width,height)) seen[s]++;
+            rendered += seen[s]-shards[s].begin;
+        }
+        if(rendered!=reported || finished){
+            reported = rendered;
+            double seconds = double(SDL_GetPerformanceCounter()-start) / SDL_GetPerformanceFrequency();
+            std::clog << "  " << rendered << "/" << frameCount << " frames, " << shardsDone << "/" << shardCount
+                      << " shards finished, " << seconds << " s\n";
         }
-        else if(line.substr(0,6)=="usemtl") currentMaterial = line.substr(7);
-        else if(line.substr(0,2)=="f "){
-            std::istringstream s(line.substr(2)); std::array<int,3> f;
-            for(int i=0;i<3;i++){
-                s>>f[i];
-                if(s.peek()=='/') while(s.peek()!=' ' && s.peek()!=EOF) s.get();
+        if(finished) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(SHARD_POLL_MS));
+    }
+    for(auto &t : threads) t.join();
+
+    // The shards each checked their own range; check the whole set once more
+    std::vector<int> missing;
+    for(int frame=firstFrame;frame<endFrame;frame++)
+        if(!frameComplete(frame,png,width,height)) missing.push_back(frame);
+    int retried = 0;
+    for(const Shard &shard : shards) retried += shard.attempts-1;
+    if(!missing.empty()){
+        std::cerr << missing.size() << " of " << frameCount << " frames missing after " << retried << " retries:";
+        for(size_t i=0;i<missing.size() && i<20;i++) std::cerr << " " << missing[i];
+        std::cerr << (missing.size()>20 ? " ...\n" : "\n");
+        return 1;
+    }
+    std::clog << "All " << frameCount << " frames present (" << retried << " shard retries)\n";
+    return 0;
+}
+
+// ============================================================
+// ======================== BENCHMARKS =========================
+// ============================================================
+
+// --bench renders a fixed set of synthetic scenes, each at three sizes and
+// in each of the three shading modes, through draw() and reports ms/frame,
+// triangles/s (faces drawn, after LOD selection) and pixels/s (depth test
+// passes). Scenes are written to bench/ as OBJ files from a fixed seed, and
+// every scene follows the same camera path, so runs are comparable between
+// machines and commits. --bench-out writes one JSON object per scene and
+// mode; --bench-baseline reads such a file back and fails the run if a
+// result got more than BENCH_TOLERANCE slower than the baseline entry with
+// the same configuration (see benchConfigFields).
+#define BENCH_TOLERANCE 0.10
+#define BENCH_WARMUP_FRAMES 2
+
+const char* benchKinds[] = { "sphere", "grid", "overdraw", "tiny", "huge" };
+const char benchSizes[] = { 's', 'm', 'l' };
+
+struct ObjWriter {
+    FILE* f;
+    int vertexCount = 0;
+
+    int vertex(const glm::vec3 &v){
+        std::fprintf(f, "v %.6f %.6f %.6f\n", v.x, v.y, v.z);
+        return ++vertexCount;
+    }
+    void face(int a, int b, int c){ std::fprintf(f, "f %d %d %d\n", a, b, c); }
+    void material(const char* name){ std::fprintf(f, "usemtl %s\n", name); }
+};
+
+// Writes scene kind at size level (0..2) to path. zoom is the camera scale
+// the scene is meant to be viewed at, relative to the fitted view.
+bool writeBenchScene(const std::string &kind, int level, const std::string &path, float &zoom){
+    FILE* f = std::fopen(path.c_str(), "w");
+    if(!f){
+        std::cerr << "Failed to write benchmark scene: " << path << "\n";
+        return false;
+    }
+    std::fprintf(f, "mtllib bench.mtl\n");
+    ObjWriter obj{f};
+    std::mt19937 rng(1234 + level);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    zoom = 1.0f;
+
+    if(kind=="sphere"){
+        // UV sphere, about seg*seg triangles
+        int seg = 32 << (2*level), rings = seg/2;
+        obj.material("red");
+        std::vector<int> ids;
+        for(int r=0;r<=rings;r++)
+            for(int s=0;s<seg;s++){
+                float theta = float(M_PI)*r/rings, phi = 2.0f*float(M_PI)*s/seg;
+                ids.push_back(obj.vertex(glm::vec3(std::sin(theta)*std::cos(phi), std::cos(theta),
+                                                   std::sin(theta)*std::sin(phi))));
+            }
+        for(int r=0;r<rings;r++)
+            for(int s=0;s<seg;s++){
+                int a = ids[r*seg + s], b = ids[r*seg + (s+1)%seg];
+                int c = ids[(r+1)*seg + s], d = ids[(r+1)*seg + (s+1)%seg];
+                if(r>0) obj.face(a, b, c);
+                if(r<rings-1) obj.face(b, d, c);
+            }
+    }
+    else if(kind=="grid"){
+        // Rippled height field of n*n quads
+        int n = 32 << (2*level);
+        obj.material("green");
+        for(int z=0;z<=n;z++)
+            for(int x=0;x<=n;x++){
+                float px = 2.0f*x/n - 1.0f, pz = 2.0f*z/n - 1.0f;
+                obj.vertex(glm::vec3(px, 0.1f*std::sin(6.0f*px)*std::cos(6.0f*pz), pz));
             }
-            model.faces.push_back(f);
-            model.faceMaterials.push_back(currentMaterial);
-
-            if(currentMaterial=="Floor"){
-                glm::vec3 v0=model.vertices[f[0]-1];
-                glm::vec3 v1=model.vertices[f[1]-1];
-                glm::vec3 v2=model.vertices[f[2]-1];
-                model.faceUVs[model.faces.size()-1]={
-                    { normalizeUV(v0.x,v0.z),
-                      normalizeUV(v1.x,v1.z),
-                      normalizeUV(v2.x,v2.z) }
-                };
+        for(int z=0;z<n;z++)
+            for(int x=0;x<n;x++){
+                int a = z*(n+1) + x + 1, b = a + 1, c = a + n + 1, d = c + 1;
+                obj.face(a, c, b);
+                obj.face(b, c, d);
             }
+    }
+    else if(kind=="overdraw"){
+        // Screen-sized quads stacked back to front, so every layer passes the depth test
+        int layers = 4 << (2*level);
+        const char* colors[] = { "red", "green", "blue", "grey" };
+        for(int i=0;i<layers;i++){
+            float z = layers>1 ? 2.0f*i/(layers-1) - 1.0f : 0.0f;
+            obj.material(colors[i%4]);
+            int a = obj.vertex(glm::vec3(-1, -1, z)), b = obj.vertex(glm::vec3(1, -1, z));
+            int c = obj.vertex(glm::vec3(1, 1, z)), d = obj.vertex(glm::vec3(-1, 1, z));
+            obj.face(a, b, c);
+            obj.face(a, c, d);
+        }
+    }
+    else if(kind=="tiny"){
+        // Randomly oriented triangles a pixel or two across, spread through a cube
+        int count = 10000*(level==0 ? 1 : level==1 ? 5 : 25);
+        obj.material("blue");
+        for(int i=0;i<count;i++){
+            glm::vec3 c(unit(rng), unit(rng), unit(rng));
+            glm::vec3 u(unit(rng), unit(rng), unit(rng)), v(unit(rng), unit(rng), unit(rng));
+            obj.face(obj.vertex(c), obj.vertex(c + 0.006f*u), obj.vertex(c + 0.006f*v));
         }
-        else if(line.substr(0,6)=="mtllib"){
-            std::string mtlFile=line.substr(7);
-            model.materials = loadMTL("box/"+mtlFile);
-            model.materials["Floor"].textured = true;
+    }
+    else if(kind=="huge"){
+        // Large triangles around the centre, viewed zoomed in so each covers the window
+        int count = 2 << (2*level);
+        zoom = 8.0f;
+        const char* colors[] = { "red", "green", "blue", "grey" };
+        for(int i=0;i<count;i++){
+            float angle = 2.0f*float(M_PI)*i/count, z = 0.2f*unit(rng);
+            obj.material(colors[i%4]);
+            glm::vec3 p[3];
+            for(int k=0;k<3;k++){
+                float a = angle + 2.0f*float(M_PI)*k/3.0f;
+                p[k] = glm::vec3(std::cos(a), std::sin(a), z + 0.1f*unit(rng));
+            }
+            obj.face(obj.vertex(p[0]), obj.vertex(p[1]), obj.vertex(p[2]));
         }
     }
-    return model;
+    bool ok = std::fclose(f)==0;
+    if(!ok) std::cerr << "Failed to write benchmark scene: " << path << "\n";
+    return ok;
 }
 
-glm::vec2 project(const glm::vec3 &v){
-    glm::mat4 rot = glm::rotate(glm::mat4(1.0f), orbitX, glm::vec3(0,1,0));
-    rot = glm::rotate(rot, orbitY, glm::vec3(1,0,0));
-    glm::vec4 pv = rot * glm::vec4(v,1.0f);
-    return glm::vec2(pv.x*scale + WIDTH/2.0f + panOffset.x,
-                     -pv.y*scale + HEIGHT/2.0f + panOffset.y + tiltOffset);
+// Value of "key" in one line of --bench-out output, without quotes
+std::string benchField(const std::string &line, const std::string &key){
+    size_t p = line.find("\"" + key + "\":");
+    if(p==std::string::npos) return "";
+    p += key.size() + 3;
+    size_t end = line.find_first_of(",}", p);
+    std::string value = line.substr(p, end==std::string::npos ? std::string::npos : end - p);
+    if(value.size()>=2 && value.front()=='"') value = value.substr(1, value.size() - 2);
+    return value;
 }
 
-glm::vec3 barycentric(const glm::vec2 &p,const glm::vec2 &a,const glm::vec2 &b,const glm::vec2 &c){
-    float det = (b.y-c.y)*(a.x-c.x) + (c.x-b.x)*(a.y-c.y);
-    float w1 = ((b.y-c.y)*(p.x-c.x) + (c.x-b.x)*(p.y-c.y))/det;
-    float w2 = ((c.y-a.y)*(p.x-c.x) + (a.x-c.x)*(p.y-c.y))/det;
-    float w3 = 1.0f-w1-w2;
-    return glm::vec3(w1,w2,w3);
+// The fields of a --bench-out record that describe what was measured. A
+// baseline entry is only compared against a result whose fields all match.
+const char* benchConfigFields[] = { "shading", "scene", "width", "height", "threads", "projection", "pipeline", "lod" };
+
+std::string benchConfig(const std::string &record){
+    std::string config;
+    for(const char* field : benchConfigFields) config += benchField(record, field) + "|";
+    return config;
 }
 
-glm::vec3 faceNormal(const glm::vec3 &v0,const glm::vec3 &v1,const glm::vec3 &v2){
-    return glm::normalize(glm::cross(v1-v0,v2-v0));
+// The materials every benchmark scene uses
+bool writeBenchMaterials(){
+    ensureFolder("bench");
+    FILE* mtl = std::fopen("bench/bench.mtl", "w");
+    if(!mtl){
+        std::cerr << "Failed to write bench/bench.mtl\n";
+        return false;
+    }
+    std::fprintf(mtl, "newmtl red\nKd 0.9 0.2 0.2\nnewmtl green\nKd 0.2 0.8 0.3\n"
+                      "newmtl blue\nKd 0.2 0.3 0.9\nnewmtl grey\nKd 0.7 0.7 0.7\n");
+    return std::fclose(mtl)==0;
 }
 
-glm::vec3 sampleTexture(int faceIndex,const glm::vec3 &bc,const Model &model){
-    if(floorTexture==nullptr) return glm::vec3(1.0f,1.0f,1.0f);
+int runBenchmarks(int frames, const std::string &filter, const std::string &outPath, const std::string &baselinePath){
+    if(!writeBenchMaterials()) return -1;
 
-    auto &uvs = model.faceUVs.at(faceIndex);
-    float u = bc.x*uvs[0].x + bc.y*uvs[1].x + bc.z*uvs[2].x;
-    float v = bc.x*uvs[0].y + bc.y*uvs[1].y + bc.z*uvs[2].y;
+    std::map<std::string, double> baseline;   // benchConfig -> ms/frame
+    if(!baselinePath.empty()){
+        std::ifstream file(baselinePath);
+        if(!file.is_open()){
+            std::cerr << "Failed to open benchmark baseline: " << baselinePath << "\n";
+            return -1;
+        }
+        std::string line;
+        while(std::getline(file, line)){
+            std::string value = benchField(line, "ms_per_frame");
+            if(value.empty()) continue;
+            double ms = 0.0;
+            const char* end = value.data() + value.size();
+            auto r = std::from_chars(value.data(), end, ms);
+            if(r.ec!=std::errc() || r.ptr!=end){
+                std::cerr << "Skipping bad baseline line: " << line << "\n";
+                continue;
+            }
+            baseline[benchConfig(line)] = ms;
+        }
+    }
+    FILE* out = nullptr;
+    if(!outPath.empty() && !(out = std::fopen(outPath.c_str(), "a"))){
+        std::cerr << "Failed to open benchmark output: " << outPath << "\n";
+        return -1;
+    }
 
-    u = std::clamp(u,0.0f,1.0f);
-    v = std::clamp(v,0.0f,1.0f);
+    useMeshCache = false;
+    ShadingMode requestedMode = shadingMode;
+    std::printf("Benchmark: %dx%d, %d threads, %s, %s, %s, %d frames per scene and shading mode\n",
+                mainFrame.framebuffer.width, mainFrame.framebuffer.height, tiledRaster ? rasterThreads : 1,
+                projection==PROJECTION_PERSPECTIVE ? "perspective" : "ortho",
+                deferredShading ? "deferred" : "forward", lodEnabled ? "LOD" : "no LOD", frames);
+    int regressions = 0, benchFrame = 0;
+    for(const char* kind : benchKinds)
+        for(int level=0;level<3;level++){
+            std::string name = std::string(kind) + "-" + benchSizes[level];
+            if(!filter.empty() && name.find(filter)==std::string::npos) continue;
+            std::string path = "bench/" + name + ".obj";
+            float zoom;
+            if(!writeBenchScene(kind, level, path, zoom)) return -1;
+            Model model = loadModel(path);
+            centerModel(model, mainFrame);
+            Camera &camera = mainFrame.camera;
+            float fitScale = camera.scale;
 
-    int texX = int(u*(floorTexture->w-1));
-    int texY = int((1.0f-v)*(floorTexture->h-1));
+            for(int mode=0;mode<SHADING_MODE_COUNT;mode++){
+                shadingMode = ShadingMode(mode);
 
-    uint32_t* pixels=(uint32_t*)floorTexture->pixels;
-    uint32_t px = pixels[texY*floorTexture->w + texX];
-    uint8_t r=(px>>16)&0xFF;
-    uint8_t g=(px>>8)&0xFF;
-    uint8_t b=px&0xFF;
-    return glm::vec3(r/255.0f,g/255.0f,b/255.0f);
-}
-
-void drawTriangle(DrawingWindow &window,int faceIndex,const glm::vec3 &v0,const glm::vec3 &v1,const glm::vec3 &v2,const Model &model){
-    glm::vec2 p0=project(v0);
-    glm::vec2 p1=project(v1);
-    glm::vec2 p2=project(v2);
-
-    int minX=std::floor(std::min({p0.x,p1.x,p2.x}));
-    int maxX=std::ceil (std::max({p0.x,p1.x,p2.x}));
-    int minY=std::floor(std::min({p0.y,p1.y,p2.y}));
-    int maxY=std::ceil (std::max({p0.y,p1.y,p2.y}));
-
-    minX=std::max(0,minX); maxX=std::min(WIDTH-1,maxX);
-    minY=std::max(0,minY); maxY=std::min(HEIGHT-1,maxY);
-
-    glm::vec3 n = faceNormal(v0,v1,v2);
-
-    for(int y=minY;y<=maxY;y++){
-        for(int x=minX;x<=maxX;x++){
-            glm::vec3 bc = barycentric(glm::vec2(x+0.5f,y+0.5f),p0,p1,p2);
-            if(bc.x>=0 && bc.y>=0 && bc.z>=0){
-                float z = bc.x*v0.z + bc.y*v1.z + bc.z*v2.z;
-                int idx = y*WIDTH + x;
-                if(z>zBuffer[idx]){
-                    zBuffer[idx]=z;
-
-                    glm::vec3 color;
-                    if(model.faceMaterials[faceIndex]=="Floor")
-                        color = sampleTexture(faceIndex, bc, model);
-                    else{
-                        float diffuse = std::max(0.0f, glm::dot(n, glm::normalize(lightPos-(v0+v1+v2)/3.0f)));
-                        color = model.materials.at(model.faceMaterials[faceIndex]).Kd *
-                            (ambientLight + (1.0f-ambientLight)*diffuse);
-                    }
+                // A quarter turn from the left, looking slightly down
+                Uint64 ticks = 0;
+                long pixels = 0, triangles = 0;
+                for(int f=-BENCH_WARMUP_FRAMES;f<frames;f++){
+                    camera.orbitX = -0.4f + 0.8f*std::max(f, 0)/std::max(frames - 1, 1);
+                    camera.orbitY = 0.35f;
+                    camera.scale = fitScale*zoom;
+                    camera.panOffset = glm::vec2(0.0f);
+                    Uint64 begin = SDL_GetPerformanceCounter();
+                    draw(mainFrame, model);
+                    Uint64 elapsed = SDL_GetPerformanceCounter() - begin;
+                    endProfileFrame(benchFrame++, mainFrame.framebuffer);
+                    if(f<0) continue;
+                    ticks += elapsed;
+                    pixels += lastProfile.counts[COUNTER_PIXELS_WRITTEN];
+                    triangles += lastProfile.counts[COUNTER_TRIANGLES];
+                }
 
-                    uint32_t c = (255<<24)
-                                 | (uint32_t(color.r*255)<<16)
-                                 | (uint32_t(color.g*255)<<8)
-                                 | uint32_t(color.b*255);
+                double seconds = double(ticks)/SDL_GetPerformanceFrequency();
+                double msPerFrame = 1000.0*seconds/frames;
+                double trianglesPerSecond = triangles/seconds;
+                double pixelsPerSecond = pixels/seconds;
+                char record[512];
+                std::snprintf(record, sizeof(record),
+                              "{\"shading\":\"%s\",\"scene\":\"%s\",\"width\":%d,\"height\":%d,\"threads\":%d,"
+                              "\"projection\":\"%s\",\"pipeline\":\"%s\",\"lod\":%s,\"frames\":%d,\"faces\":%zu,\"triangles\":%ld,"
+                              "\"ms_per_frame\":%.4f,\"triangles_per_s\":%.0f,\"pixels_per_s\":%.0f}",
+                              shadingModeNames[shadingMode], name.c_str(), mainFrame.framebuffer.width, mainFrame.framebuffer.height,
+                              tiledRaster ? rasterThreads : 1,
+                              projection==PROJECTION_PERSPECTIVE ? "perspective" : "ortho",
+                              deferredShading ? "deferred" : "forward", lodEnabled ? "true" : "false", frames,
+                              model.faces.size(), triangles/frames, msPerFrame, trianglesPerSecond, pixelsPerSecond);
 
-                    window.setPixelColour(x,y,c);
+                std::printf("  %-12s %-9s %8ld tris %10.3f ms/frame %9.2f Mtri/s %9.2f Mpix/s", name.c_str(),
+                            shadingModeNames[shadingMode], triangles/frames, msPerFrame,
+                            trianglesPerSecond/1e6, pixelsPerSecond/1e6);
+                auto it = baseline.find(benchConfig(record));
+                if(it!=baseline.end()){
+                    double change = msPerFrame/it->second - 1.0;
+                    bool regressed = change>BENCH_TOLERANCE;
+                    regressions += regressed;
+                    std::printf("  %+6.1f%% vs baseline%s", 100.0*change, regressed ? "  REGRESSION" : "");
                 }
+                std::printf("\n");
+                std::fflush(stdout);
+                if(out) std::fprintf(out, "%s\n", record);
             }
         }
-    }
+    shadingMode = requestedMode;
+    if(out) std::fclose(out);
+    if(regressions) std::printf("%d result(s) more than %.0f%% slower than the baseline\n", regressions, 100.0*BENCH_TOLERANCE);
+    return regressions ? 1 : 0;
 }
 
-void drawModel(DrawingWindow &window,const Model &model){
-    for(size_t i=0;i<model.faces.size();i++){
-        const auto &f = model.faces[i];
-        glm::vec3 v[3] = {
-            model.vertices[f[0]-1],
-            model.vertices[f[1]-1],
-            model.vertices[f[2]-1]
-        };
-        drawTriangle(window,i,v[0],v[1],v[2],model);
+// Edges of model, with coincident vertices merged, that do not join exactly
+// two faces: none for a closed surface
+size_t openEdges(const Model &model){
+    std::map<std::array<float,3>, int> ids;
+    auto id = [&](int v){
+        const glm::vec3 &p = model.vertices[v-1];
+        return ids.emplace(std::array<float,3>{ p.x, p.y, p.z }, int(ids.size())).first->second;
+    };
+    std::map<std::pair<int,int>, int> faceCounts;
+    for(const auto &f : model.faces)
+        for(int k=0;k<3;k++){
+            int a = id(f[k]), b = id(f[(k+1)%3]);
+            if(a!=b) faceCounts[{ std::min(a,b), std::max(a,b) }]++;
+        }
+    size_t open = 0;
+    for(const auto &e : faceCounts) open += e.second!=2;
+    return open;
+}
+
+// Background pixels that background from the edge of the frame cannot reach:
+// seen through a hole in the model. A notch in the outline of a simplified
+// model is open to the outside and does not count.
+long holePixels(const Framebuffer &fb){
+    std::vector<uint8_t> outside(size_t(fb.width)*fb.height, 0);
+    std::vector<std::pair<int,int>> stack;
+    auto reach = [&](int x,int y){
+        if(x<0 || y<0 || x>=fb.width || y>=fb.height) return;
+        uint8_t &o = outside[size_t(y)*fb.width+x];
+        if(o || fb.color[size_t(y)*fb.stride+x]) return;
+        o = 1;
+        stack.push_back({ x, y });
+    };
+    for(int x=0;x<fb.width;x++){ reach(x,0); reach(x,fb.height-1); }
+    for(int y=0;y<fb.height;y++){ reach(0,y); reach(fb.width-1,y); }
+    while(!stack.empty()){
+        auto [x,y] = stack.back();
+        stack.pop_back();
+        reach(x-1,y); reach(x+1,y); reach(x,y-1); reach(x,y+1);
     }
+    long holes = 0;
+    for(int y=0;y<fb.height;y++)
+        for(int x=0;x<fb.width;x++)
+            holes += !fb.color[size_t(y)*fb.stride+x] && !outside[size_t(y)*fb.width+x];
+    return holes;
 }
 
-void computeBoundingBox(const Model &model, glm::vec3 &minV, glm::vec3 &maxV){
-    if(model.vertices.empty()) return;
-    minV=maxV=model.vertices[0];
-    for(const auto &v:model.vertices){
-        minV = glm::min(minV,v);
-        maxV = glm::max(maxV,v);
+// --verify-lod: every LOD built from a closed model must be closed too and
+// render without holes. The model is the benchmark sphere, which repeats
+// the pole vertex once per slice, so its poles are borders by vertex index
+// but not by position. Each LOD is checked for open edges and rendered
+// from views all around, including over both poles, looking for holes.
+int verifyLOD(){
+    if(!writeBenchMaterials()) return -1;
+    useMeshCache = false;
+    shadingMode = SHADING_FLAT;
+    long failures = 0;
+    int profileFrame = 0;
+    for(int level=1;level<3;level++){   // sphere-s is below LOD_MIN_FACES
+        std::string path = std::string("bench/sphere-") + benchSizes[level] + ".obj";
+        float zoom;
+        if(!writeBenchScene("sphere", level, path, zoom)) return -1;
+        lodEnabled = true;
+        Model model = loadModel(path);
+        centerModel(model, mainFrame);
+        lodEnabled = false;   // draw each level as given
+        if(model.lods.empty()){
+            std::cout << path << ": no LODs built\n";
+            failures++;
+        }
+        for(size_t i=0;i<=model.lods.size();i++){
+            const Model &lod = i==0 ? model : model.lods[i-1];
+            size_t open = openEdges(lod);
+            long holes = 0;
+            for(float orbitY : { 0.0f, 0.7f, 1.5f, -1.5f })
+                for(int view=0;view<4;view++){
+                    mainFrame.camera.orbitX = 0.3f + view*float(M_PI)/2.0f;
+                    mainFrame.camera.orbitY = orbitY;
+                    draw(mainFrame, lod);
+                    endProfileFrame(profileFrame++, mainFrame.framebuffer);
+                    holes += holePixels(mainFrame.framebuffer);
+                }
+            std::printf("%s %-6s %8zu faces  open edges %zu  hole pixels %ld\n", path.c_str(),
+                        i ? ("LOD " + std::to_string(i)).c_str() : "full", lod.faces.size(), open, holes);
+            failures += open>0 || holes>0;
+        }
     }
+    std::printf(failures ? "%ld LOD check(s) failed\n" : "All LODs closed and without holes\n", failures);
+    return failures ? 1 : 0;
 }
 
-void centerModel(Model &model){
-    glm::vec3 minV,maxV;
-    computeBoundingBox(model,minV,maxV);
-    glm::vec3 center = (minV+maxV)*0.5f;
-    for(auto &v:model.vertices) v -= center;
+// --verify-shadow-cache: after an edit that moves part of the model, the
+// faces invalidateShadowRegion picks must be all that change. Raises bumps
+// on the benchmark sphere, each shading its neighbours, and compares the
+// partly retraced cache with a full retrace.
+int verifyShadowCache(){
+    if(!writeBenchMaterials()) return -1;
+    useMeshCache = false;
+    lodEnabled = false;
+    std::string path = "bench/sphere-m.obj";
+    float zoom;
+    if(!writeBenchScene("sphere", 1, path, zoom)) return -1;
+    Model model = loadModel(path);
+    centerModel(model, mainFrame);
+    glm::vec3 center = (model.boundsMin+model.boundsMax)*0.5f;
+    float radius = glm::length(model.boundsMax-center);
 
-    glm::vec3 size = maxV-minV;
-    float scaleX = (WIDTH-40)/size.x;
-    float scaleY = (HEIGHT-40)/size.y;
-    scale = std::min(scaleX,scaleY);
-}
+    std::mt19937 rng(1);
+    std::vector<uint8_t> moved(model.vertices.size());
+    long failures = 0;
+    for(int edit=0;edit<8;edit++){
+        if(shadowBVH.nodes.empty()) buildBVH(shadowBVH, model);
+        updateShadowCache(model, shadowBVH);
 
-void draw(DrawingWindow &window,const Model &model){
-    window.clearPixels();
-    std::fill(zBuffer.begin(), zBuffer.end(), -1e10f);
-    drawModel(window,model);
-}
+        // Push the vertices near a random one outwards, bounding the faces
+        // they belong to before and after the move
+        glm::vec3 peak = model.vertices[rng()%model.vertices.size()];
+        for(size_t v=0;v<model.vertices.size();v++)
+            moved[v] = glm::length(model.vertices[v]-peak) < 0.25f*radius;
+        glm::vec3 regionMin(1e30f), regionMax(-1e30f);
+        auto growRegion = [&](){
+            for(const auto &f : model.faces)
+                if(moved[f[0]-1] || moved[f[1]-1] || moved[f[2]-1])
+                    for(int v : f){
+                        regionMin = glm::min(regionMin, model.vertices[v-1]);
+                        regionMax = glm::max(regionMax, model.vertices[v-1]);
+                    }
+        };
+        growRegion();
+        for(size_t v=0;v<model.vertices.size();v++)
+            if(moved[v]) model.vertices[v] += glm::normalize(model.vertices[v]-center)*0.3f*radius;
+        growRegion();
 
-void handleEvent(SDL_Event event){
-    if(event.type==SDL_KEYDOWN){
-        switch(event.key.keysym.sym){
-            case SDLK_w: scale *= 1.1f; break;
-            case SDLK_s: scale /= 1.1f; break;
-            case SDLK_a: panOffset.x -= 10.0f; break;
-            case SDLK_d: panOffset.x += 10.0f; break;
-            case SDLK_q: tiltOffset += 10.0f; break;
-            case SDLK_e: tiltOffset -= 10.0f; break;
-            case SDLK_LEFT:  orbitX -= 0.1f; break;
-            case SDLK_RIGHT: orbitX += 0.1f; break;
-            case SDLK_UP:    orbitY += 0.1f; break;
-            case SDLK_DOWN:  orbitY -= 0.1f; break;
-        }
+        invalidateShadowRegion(model, regionMin, regionMax);
+        std::vector<int> dirty = shadowCache.dirty;
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        buildBVH(shadowBVH, model);
+        updateShadowCache(model, shadowBVH);
+        std::vector<uint8_t> partial = shadowCache.shadowed;
+        invalidateShadowCache();
+        updateShadowCache(model, shadowBVH);
+
+        long wrong = 0;
+        for(size_t i=0;i<partial.size();i++) wrong += partial[i]!=shadowCache.shadowed[i];
+        std::printf("edit %d: %zu of %zu faces retraced, %ld differ from a full retrace\n",
+                    edit, dirty.size(), model.faces.size(), wrong);
+        failures += wrong>0;
     }
+    std::printf(failures ? "%ld shadow cache edit(s) failed\n" : "Partial shadow cache updates match full retraces\n", failures);
+    return failures ? 1 : 0;
 }
 
 // ============================================================
@@ -305,6 +933,113 @@ void handleEvent(SDL_Event event){
 // ============================================================
 
 int main(int argc,char *argv[]){
+    bool headless = false, benchShadowModes = false;
+    std::string objPath = "box/box.obj", cameraPath;
+    bool bench = false, verifyRasterKernels = false, verifyLODs = false, verifyShadows = false;
+    int benchFrames = 30;
+    std::string benchFilter, benchOut, benchBaseline;
+    std::string sinkFormat = "png", sinkOut;
+    int frameCount = -1, frameWorkers = 1, firstFrame = 0;
+    int shardCount = 0, shardRetries = 2;
+    for(int i=1;i<argc;i++){
+        std::string arg = argv[i];
+        if(arg=="--headless") headless = true;
+        else if(arg=="--obj" && i+1<argc) objPath = argv[++i];
+        else if(arg=="--camera" && i+1<argc) cameraPath = argv[++i];
+        else if(arg=="--frames" && i+1<argc) frameCount = std::stoi(argv[++i]);
+        else if(arg=="--first-frame" && i+1<argc) firstFrame = std::max(0, std::stoi(argv[++i]));
+        else if(arg=="--shards" && i+1<argc) shardCount = std::max(1, std::stoi(argv[++i]));
+        else if(arg=="--shard-retries" && i+1<argc) shardRetries = std::max(0, std::stoi(argv[++i]));
+        else if(arg=="--threads" && i+1<argc) setThreadCount(std::stoi(argv[++i]));
+        else if(arg=="--serial-raster") tiledRaster = false;
+        else if(arg=="--frame-workers" && i+1<argc) frameWorkers = std::max(1, std::stoi(argv[++i]));
+        else if(arg=="--encoders" && i+1<argc) encoderThreads = std::max(1, std::stoi(argv[++i]));
+        else if(arg=="--sink" && i+1<argc) sinkFormat = argv[++i];
+        else if(arg=="--out" && i+1<argc) sinkOut = argv[++i];
+        else if(arg=="--no-cache") useMeshCache = false;
+        else if(arg=="--no-cull") cullingEnabled = false;
+        else if(arg=="--no-hiz") hiZ = false;
+        else if(arg=="--no-lod") lodEnabled = false;
+        else if(arg=="--deferred") deferredShading = true;
+        else if(arg=="--bench") bench = true;
+        else if(arg=="--bench-frames" && i+1<argc) benchFrames = std::max(1, std::stoi(argv[++i]));
+        else if(arg=="--bench-filter" && i+1<argc) benchFilter = argv[++i];
+        else if(arg=="--bench-out" && i+1<argc) benchOut = argv[++i];
+        else if(arg=="--bench-baseline" && i+1<argc) benchBaseline = argv[++i];
+        else if(arg=="--profile" && i+1<argc){
+            if(!openProfileLog(argv[++i])) return -1;
+        }
+        else if(arg=="--trace" && i+1<argc) startTrace(argv[++i]);
+        else if(arg=="--size" && i+1<argc){
+            int w = 0, h = 0;
+            if(std::sscanf(argv[++i], "%dx%d", &w, &h)!=2 || w<=0 || h<=0){
+                std::cerr << "Bad frame size: " << argv[i] << " (expected WxH, e.g. 3840x2160)" << std::endl;
+                return -1;
+            }
+            mainFrame.framebuffer.resize(w,h);
+        }
+        else if(arg=="--filter" && i+1<argc){
+            std::string name = argv[++i];
+            int k = std::find(textureFilterNames, textureFilterNames+3, name) - textureFilterNames;
+            if(k==3){ std::cerr << "Unknown texture filter: " << name << std::endl; return -1; }
+            textureFilter = TextureFilter(k);
+        }
+        else if(arg=="--hiz-sort") hiZSort = true;
+        else if(arg=="--projection" && i+1<argc){
+            std::string mode = argv[++i];
+            projection = mode=="perspective" ? PROJECTION_PERSPECTIVE : PROJECTION_ORTHO;
+        }
+        else if(arg=="--fov" && i+1<argc) fieldOfView = std::stof(argv[++i]);
+        else if(arg=="--near" && i+1<argc) nearPlane = std::stof(argv[++i]);
+        else if(arg=="--far" && i+1<argc) farPlane = std::stof(argv[++i]);
+        else if(arg=="--verify-raster") verifyRasterKernels = true;
+        else if(arg=="--verify-lod") verifyLODs = true;
+        else if(arg=="--verify-shadow-cache") verifyShadows = true;
+        else if(arg=="--raster" && i+1<argc){
+            std::string name = argv[++i];
+            int k = std::find(rasterKernelNames, rasterKernelNames+RASTER_KERNEL_COUNT, name) - rasterKernelNames;
+            if(k==RASTER_KERNEL_COUNT || !rasterKernel(RasterKernel(k))){
+                std::cerr << "Raster kernel not available: " << name << std::endl;
+                return -1;
+            }
+            activeRasterKernel = RasterKernel(k);
+            coverBlock = rasterKernel(activeRasterKernel);
+        }
+        else if(arg=="--shadows" && i+1<argc){
+            std::string mode = argv[++i];
+            shadowMode = mode=="map" ? SHADOW_MAP : SHADOW_RAY;
+        }
+        else if(arg=="--bench-shadows") benchShadowModes = true;
+        else if(arg=="--shading" && i+1<argc){
+            std::string name = argv[++i];
+            int k = std::find(shadingModeNames, shadingModeNames+SHADING_MODE_COUNT, name) - shadingModeNames;
+            if(k==SHADING_MODE_COUNT){ std::cerr << "Unknown shading mode: " << name << std::endl; return -1; }
+            shadingMode = ShadingMode(k);
+        }
+        else if(arg=="--spin") autoRotate = true;
+        else{
+            std::cerr << "Usage: " << argv[0]
+                      << " [--headless] [--obj file.obj] [--camera path.txt] [--size WxH] [--first-frame N] [--frames N]\n"
+                      << "       [--threads N] [--serial-raster] [--frame-workers N] [--shards N] [--shard-retries N] [--encoders N]\n"
+                      << "       [--sink png|ppm|y4m|raw] [--out file|-] [--no-cache] [--no-cull] [--no-hiz] [--no-lod] [--hiz-sort] [--deferred]\n"
+                      << "       [--filter nearest|bilinear|trilinear] [--profile log.csv|log.json] [--trace trace.json]\n"
+                      << "       [--projection ortho|perspective] [--fov degrees] [--near d] [--far d]\n"
+                      << "       [--shading flat|shadowed|gouraud] [--shadows ray|map] [--bench-shadows] [--spin]\n"
+                      << "       [--raster scalar|sse|avx2] [--verify-raster] [--verify-lod] [--verify-shadow-cache]\n"
+                      << "       [--bench] [--bench-frames N] [--bench-filter name] [--bench-out results.json] [--bench-baseline results.json]\n";
+            return -1;
+        }
+    }
+    // Before any mode returns, so every one of them writes --profile/--trace
+    std::atexit(finishProfiler);
+    if(verifyRasterKernels) return verifyRaster(mainFrame.framebuffer.width,mainFrame.framebuffer.height);
+    if(benchShadowModes) return benchShadows(objPath,frameCount);
+    if(verifyLODs) return verifyLOD();
+    if(verifyShadows) return verifyShadowCache();
+    if(bench) return runBenchmarks(benchFrames,benchFilter,benchOut,benchBaseline);
+    if(shardCount) return runSharded(argc,argv,objPath,cameraPath,firstFrame,frameCount,sinkFormat,shardCount,shardRetries);
+    if(headless) return runHeadless(objPath,cameraPath,firstFrame,frameCount,sinkFormat,sinkOut,frameWorkers);
+
     if(SDL_Init(SDL_INIT_VIDEO)!=0){
         std::cerr<<"SDL Init Failed"<<std::endl;
         return -1;
@@ -314,35 +1049,70 @@ int main(int argc,char *argv[]){
         return -1;
     }
 
-    DrawingWindow window(WIDTH,HEIGHT,false);
+    DrawingWindow window(mainFrame.framebuffer.width,mainFrame.framebuffer.height,false);
     SDL_Event event;
 
-    if(!loadTexture("box/ground.png"))
+    std::string dir = objPath.substr(0, objPath.find_last_of("/\\")+1);
+    floorTexture = loadTexture(dir+"ground.png", false);
+    if(floorTexture<0)
         return -1;
 
-    Model box = loadOBJ("box/box.obj");
-    centerModel(box);
+    Model box = loadModel(objPath);
+    centerModel(box,mainFrame);
+    bool lodsBuilt = lodEnabled;   // --no-lod skips them until V turns LODs on
 
-    ensureFramesFolder();
+    frameSink = makeFrameSink(sinkFormat, sinkOut, mainFrame.framebuffer.width, mainFrame.framebuffer.height);
+    if(!frameSink) return -1;
     int frameCounter = 0;
 
-    Uint64 lastTime = SDL_GetPerformanceCounter();
-    double targetFrame = 1.0 / 30.0;
+    // At most 30 frames a second, and only when the scene revision moved.
+    // Exposing or resizing the window presents the last frame again.
+    // Between frames the loop sleeps in SDL_WaitEventTimeout, which returns
+    // early on input, so an idle window costs no CPU.
+    const Uint64 frameTicks = SDL_GetPerformanceFrequency() / 30;
+    const int idleWaitMs = 250;
+    Uint64 nextFrame = SDL_GetPerformanceCounter();
+    uint64_t drawnRevision = sceneRevision-1;
 
     while(true){
         while(window.pollForInputEvents(event))
             handleEvent(event);
+        if(lodEnabled && !lodsBuilt){
+            buildLODs(box);
+            lodsBuilt = true;
+        }
 
         Uint64 now = SDL_GetPerformanceCounter();
-        double dt = double(now - lastTime) / SDL_GetPerformanceFrequency();
+        if(now >= nextFrame){
+            if(autoRotate){
+                mainFrame.camera.orbitX += 0.01f;
+                sceneRevision++;
+            }
+            if(sceneRevision != drawnRevision){
+                drawnRevision = sceneRevision;
+                nextFrame = now + frameTicks;
 
-        if(dt >= targetFrame){
-            lastTime = now;
+                draw(mainFrame,box);
+                presentFrame(window,mainFrame.framebuffer);
+                window.renderFrame();
 
-            draw(window,box);
+                frameSink->write(mainFrame.framebuffer, frameCounter);
+                endProfileFrame(frameCounter++, mainFrame.framebuffer);
+                windowStale = false;
+            }
+        }
+        // The scene did not change, so the finished frame is still right
+        if(windowStale){
+            presentFrame(window,mainFrame.framebuffer);
             window.renderFrame();
+            windowStale = false;
+        }
 
-            saveFramePNG(window, frameCounter++);
+        int waitMs = idleWaitMs;
+        if(autoRotate || sceneRevision != drawnRevision){
+            now = SDL_GetPerformanceCounter();
+            waitMs = now >= nextFrame ? 0 : int(1000*(nextFrame-now) / SDL_GetPerformanceFrequency()) + 1;
         }
+        if(waitMs > 0) SDL_WaitEventTimeout(nullptr, waitMs);
     }
 }
@@ -0,0 +1,3732 @@
+#pragma once
+
+// The renderer shared by every shading mode: frame output, loading,
+// shadows, vertex processing, setup and rasterization. main.cpp adds input
+// handling, the headless and benchmark runners and the command line.
+// Header-only: every function and global defined here is inline, so any
+// number of translation units can include it and still link.
+
+#include <DrawingWindow.h>
+#include <Utils.h>
+#include <SDL2/SDL_image.h>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <cstring>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <new>
+#include <charconv>
+#include <random>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// ============================================================
+// ======================= FRAMEBUFFER =========================
+// ============================================================
+
+// Cache-line (64-byte) aligned storage for image planes
+template<typename T>
+struct AlignedAllocator {
+    using value_type = T;
+    AlignedAllocator() = default;
+    template<typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(64))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(64)); }
+    template<typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+template<typename T> using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// The render target: color and depth planes of a size picked at startup
+// (--size). Pixel (x,y) is at y*stride+x in both planes. The stride rounds
+// the width up to 16 pixels, so every row starts on a cache line.
+struct Framebuffer {
+    int width = 0, height = 0;
+    int stride = 0;
+    AlignedVector<uint32_t> color;   // ARGB
+    AlignedVector<float> depth;      // larger is nearer
+
+    Framebuffer(int w, int h) { resize(w, h); }
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        stride = (w + 15) & ~15;
+        color.assign(size_t(stride) * h, 0u);
+        depth.assign(size_t(stride) * h, -1e10f);
+    }
+};
+
+
+// ============================================================
+// ========================= PROFILER ==========================
+// ============================================================
+
+// Per-frame stage timings and counters. A ProfileScope adds the wall time
+// of its block to one stage of the current frame; encoding runs on its own
+// threads, so its time is summed over them and lands in the frame during
+// which it finished. Hot paths bump thread-local counts, which are folded
+// into the frame when a parallelFor worker ends and at the end of draw().
+// endProfileFrame() closes a frame for the --profile log (CSV, or one JSON
+// object per line), the overlay and the run summary. With --trace every
+// scope, plus one per raster tile, is kept as a Chrome trace event
+// (chrome://tracing or Perfetto) and written out at exit.
+enum ProfileStage { STAGE_FRAME, STAGE_VERTICES, STAGE_SHADOW_CACHE, STAGE_SHADOW_MAP, STAGE_SETUP,
+                    STAGE_RASTER, STAGE_RESOLVE, STAGE_PRESENT, STAGE_SINK, STAGE_ENCODE, STAGE_COUNT };
+inline const char* profileStageNames[STAGE_COUNT] = { "frame", "vertices", "shadow_cache", "shadow_map",
+    "setup", "raster", "resolve", "present", "sink", "encode" };
+
+enum ProfileCounter { COUNTER_TRIANGLES, COUNTER_CULLED, COUNTER_PIXELS_TESTED,
+                      COUNTER_PIXELS_WRITTEN, COUNTER_PIXELS_SHADED, COUNTER_TEXTURE_SAMPLES,
+                      COUNTER_SHADOW_RAYS, COUNTER_COUNT };
+inline const char* profileCounterNames[COUNTER_COUNT] = { "triangles", "culled", "pixels_tested",
+    "pixels_written", "pixels_shaded", "texture_samples", "shadow_rays" };
+
+struct FrameProfile {
+    int frame = 0;
+    double ms[STAGE_COUNT] = {};
+    long counts[COUNTER_COUNT] = {};
+    double overdraw = 0.0;   // depth writes per framebuffer pixel
+};
+
+inline std::atomic<Uint64> stageTicks[STAGE_COUNT];
+inline std::atomic<long> frameCounters[COUNTER_COUNT];
+inline thread_local long profileCounts[COUNTER_COUNT];
+
+inline FrameProfile lastProfile;     // the latest finished frame
+inline FrameProfile profileTotals;   // sums over every finished frame
+inline int profiledFrames = 0;
+inline bool profileOverlay = false;
+
+inline FILE* profileLog = nullptr;
+inline bool profileLogCSV = false;
+
+struct TraceEvent {
+    const char* name;
+    int thread;
+    Uint64 begin, end;
+};
+
+inline bool tracing = false;
+inline std::string tracePath;
+inline Uint64 traceStart = 0;
+inline std::mutex traceMutex;
+inline std::vector<TraceEvent> traceEvents;
+inline std::vector<std::pair<Uint64, FrameProfile>> traceFrames;   // counter samples
+inline std::atomic<int> traceThreadCount{0};
+inline thread_local int traceThread = -1;
+
+inline double ticksToMs(Uint64 ticks) {
+    return 1000.0 * double(ticks) / SDL_GetPerformanceFrequency();
+}
+
+inline void recordTrace(const char* name, Uint64 begin, Uint64 end) {
+    if (traceThread < 0) traceThread = traceThreadCount++;
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.push_back({name, traceThread, begin, end});
+}
+
+// Times the enclosing block as one stage of the current frame
+struct ProfileScope {
+    ProfileStage stage;
+    Uint64 begin;
+    explicit ProfileScope(ProfileStage s) : stage(s), begin(SDL_GetPerformanceCounter()) {}
+    ~ProfileScope() {
+        Uint64 end = SDL_GetPerformanceCounter();
+        stageTicks[stage] += end - begin;
+        if (tracing) recordTrace(profileStageNames[stage], begin, end);
+    }
+};
+
+// A trace event only, for work too fine to time as a stage
+struct TraceScope {
+    const char* name;
+    Uint64 begin;
+    explicit TraceScope(const char* n) : name(n), begin(tracing ? SDL_GetPerformanceCounter() : 0) {}
+    ~TraceScope() { if (tracing) recordTrace(name, begin, SDL_GetPerformanceCounter()); }
+};
+
+// Moves this thread's counts into the current frame
+inline void flushProfileCounters() {
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        if (profileCounts[c]) frameCounters[c] += profileCounts[c];
+        profileCounts[c] = 0;
+    }
+}
+
+inline void printProfile(std::ostream &out, const FrameProfile &p, int frames) {
+    out << "Stage ms" << (frames > 1 ? " per frame:" : ":");
+    for (int s = 0; s < STAGE_COUNT; s++) out << " " << profileStageNames[s] << " " << p.ms[s] / frames;
+    out << "\nCounters" << (frames > 1 ? " per frame:" : ":");
+    for (int c = 0; c < COUNTER_COUNT; c++) out << " " << profileCounterNames[c] << " " << p.counts[c] / frames;
+    out << " overdraw " << p.overdraw / frames << "\n";
+}
+
+inline bool openProfileLog(const std::string &path) {
+    profileLog = std::fopen(path.c_str(), "w");
+    if (!profileLog) {
+        std::cerr << "Failed to open profile log: " << path << "\n";
+        return false;
+    }
+    profileLogCSV = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    if (profileLogCSV) {
+        std::fprintf(profileLog, "frame");
+        for (int s = 0; s < STAGE_COUNT; s++) std::fprintf(profileLog, ",%s_ms", profileStageNames[s]);
+        for (int c = 0; c < COUNTER_COUNT; c++) std::fprintf(profileLog, ",%s", profileCounterNames[c]);
+        std::fprintf(profileLog, ",overdraw\n");
+    }
+    return true;
+}
+
+inline void writeProfileRow(const FrameProfile &p) {
+    if (profileLogCSV) {
+        std::fprintf(profileLog, "%d", p.frame);
+        for (int s = 0; s < STAGE_COUNT; s++) std::fprintf(profileLog, ",%.4f", p.ms[s]);
+        for (int c = 0; c < COUNTER_COUNT; c++) std::fprintf(profileLog, ",%ld", p.counts[c]);
+        std::fprintf(profileLog, ",%.4f\n", p.overdraw);
+        return;
+    }
+    std::fprintf(profileLog, "{\"frame\":%d,\"ms\":{", p.frame);
+    for (int s = 0; s < STAGE_COUNT; s++) std::fprintf(profileLog, "%s\"%s\":%.4f", s ? "," : "", profileStageNames[s], p.ms[s]);
+    std::fprintf(profileLog, "},\"counters\":{");
+    for (int c = 0; c < COUNTER_COUNT; c++) std::fprintf(profileLog, "%s\"%s\":%ld", c ? "," : "", profileCounterNames[c], p.counts[c]);
+    std::fprintf(profileLog, "},\"overdraw\":%.4f}\n", p.overdraw);
+}
+
+inline void startTrace(const std::string &path) {
+    tracing = true;
+    tracePath = path;
+    traceStart = SDL_GetPerformanceCounter();
+}
+
+inline void writeTrace() {
+    FILE* f = std::fopen(tracePath.c_str(), "w");
+    if (!f) {
+        std::cerr << "Failed to write trace: " << tracePath << "\n";
+        return;
+    }
+    double usPerTick = 1e6 / SDL_GetPerformanceFrequency();
+    std::fprintf(f, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (const auto &e : traceEvents) {
+        std::fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                     first ? "" : ",\n", e.name, e.thread, (e.begin - traceStart) * usPerTick, (e.end - e.begin) * usPerTick);
+        first = false;
+    }
+    for (const auto &sample : traceFrames)
+        for (int c = 0; c < COUNTER_COUNT; c++) {
+            std::fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{\"value\":%ld}}",
+                         first ? "" : ",\n", profileCounterNames[c], (sample.first - traceStart) * usPerTick,
+                         sample.second.counts[c]);
+            first = false;
+        }
+    std::fprintf(f, "\n]}\n");
+    std::fclose(f);
+    std::clog << "Wrote " << traceEvents.size() << " trace events to " << tracePath << "\n";
+}
+
+// Flushes the log and writes the trace; registered with atexit
+inline void finishProfiler() {
+    if (profileLog) std::fclose(profileLog);
+    profileLog = nullptr;
+    if (tracing) writeTrace();
+    tracing = false;
+}
+
+// Closes the current frame: everything timed and counted since the last call
+inline void endProfileFrame(int frame, const Framebuffer &fb) {
+    flushProfileCounters();
+    FrameProfile p;
+    p.frame = frame;
+    for (int s = 0; s < STAGE_COUNT; s++) p.ms[s] = ticksToMs(stageTicks[s].exchange(0));
+    for (int c = 0; c < COUNTER_COUNT; c++) p.counts[c] = frameCounters[c].exchange(0);
+    p.overdraw = double(p.counts[COUNTER_PIXELS_WRITTEN]) / (double(fb.width) * fb.height);
+
+    lastProfile = p;
+    profiledFrames++;
+    for (int s = 0; s < STAGE_COUNT; s++) profileTotals.ms[s] += p.ms[s];
+    for (int c = 0; c < COUNTER_COUNT; c++) profileTotals.counts[c] += p.counts[c];
+    profileTotals.overdraw += p.overdraw;
+
+    if (profileLog) writeProfileRow(p);
+    if (tracing) {
+        std::lock_guard<std::mutex> lock(traceMutex);
+        traceFrames.push_back({SDL_GetPerformanceCounter(), p});
+    }
+    if (profileOverlay && frame % 30 == 0) printProfile(std::cout, p, 1);
+}
+
+// ============================================================
+// ====================== FRAME SAVING =========================
+// ============================================================
+
+inline void ensureFolder(const std::string &path) {
+#if defined(_WIN32)
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0777);
+#endif
+}
+
+inline std::string frameFileName(int frameNumber, const std::string &ext) {
+    std::string num = std::to_string(frameNumber);
+    if (num.length() < 5) num = std::string(5 - num.length(), '0') + num;  // zero pad, same as %05d
+    return "frames/frame_" + num + "." + ext;
+}
+
+// Frames are written under a ".part" name and renamed once complete, so a
+// frame file that exists is never half written, even if the process dies
+// mid-save. The sharded batch relies on this to find frames to redo.
+inline bool publishFrameFile(const std::string &part, const std::string &filename) {
+#if defined(_WIN32)
+    std::remove(filename.c_str());   // rename does not replace an existing file here
+#endif
+    return std::rename(part.c_str(), filename.c_str()) == 0;
+}
+
+inline bool saveFramePNG(SDL_Surface* surf, int frameNumber) {
+    std::string filename = frameFileName(frameNumber, "png");
+    std::string part = filename + ".part";
+
+    if (IMG_SavePNG(surf, part.c_str()) != 0)
+        std::cerr << "Failed to save PNG: " << IMG_GetError() << "\n";
+    else if (!publishFrameFile(part, filename))
+        std::cerr << "Failed to save PNG: " << filename << "\n";
+    else {
+        std::cout << ("Saved " + filename + "\n");
+        return true;
+    }
+    return false;
+}
+
+// Uncompressed binary PPM: no deflate, one write per frame
+inline bool saveFramePPM(const uint32_t* frame, int width, int height, int frameNumber) {
+    std::string filename = frameFileName(frameNumber, "ppm");
+
+    static thread_local std::vector<uint8_t> bytes;
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    bytes.resize(header.size() + width * height * 3);
+    std::memcpy(bytes.data(), header.data(), header.size());
+    uint8_t* out = bytes.data() + header.size();
+    for (int i = 0; i < width * height; i++) {
+        *out++ = (frame[i] >> 16) & 0xFF;
+        *out++ = (frame[i] >> 8) & 0xFF;
+        *out++ = frame[i] & 0xFF;
+    }
+
+    std::string part = filename + ".part";
+    FILE* f = std::fopen(part.c_str(), "wb");
+    bool ok = f && std::fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size();
+    if (f && std::fclose(f) != 0) ok = false;
+    if (!ok || !publishFrameFile(part, filename)) {
+        std::cerr << "Failed to save PPM: " << filename << "\n";
+        return false;
+    }
+    std::cout << ("Saved " + filename + "\n");
+    return true;
+}
+
+// ---------- ASYNC FRAME ENCODER ----------
+// The render loop memcpy's each finished frame into one of a fixed pool of
+// buffers and carries on; encoder threads run the encode callback on the
+// queued frames in submission order. Queued frames are packed, without the
+// framebuffer's row padding. Every buffer owns a surface made once at
+// start(), so saving a frame costs no allocations. When the whole pool is
+// queued, submit() blocks until an encoder frees a buffer. With one encoder
+// thread frames are also finished strictly in order.
+struct FrameEncoder {
+    struct Slot {
+        std::vector<uint32_t> pixels;
+        SDL_Surface* surface = nullptr;
+        int width = 0, height = 0;
+        int frameNumber = 0;
+    };
+
+    std::vector<Slot> slots;
+    std::vector<int> freeSlots;
+    std::deque<int> queued;
+    std::vector<std::thread> workers;
+    std::function<void(Slot&)> encode;
+    std::mutex mutex;
+    std::condition_variable slotFreed, frameQueued;
+    bool stopping = false;
+
+    void start(int width, int height, int encoderThreads, int poolSize, std::function<void(Slot&)> encodeFn) {
+        encode = encodeFn;
+        slots.resize(std::max(poolSize, encoderThreads));
+        for (size_t i = 0; i < slots.size(); i++) {
+            slots[i].width = width;
+            slots[i].height = height;
+            slots[i].pixels.resize(width * height);
+            slots[i].surface = SDL_CreateRGBSurfaceWithFormatFrom(
+                slots[i].pixels.data(), width, height, 32, width * 4, SDL_PIXELFORMAT_ARGB8888
+            );
+            freeSlots.push_back(i);
+        }
+        for (int i = 0; i < encoderThreads; i++)
+            workers.emplace_back([this] { encodeLoop(); });
+    }
+
+    void submit(const Framebuffer &fb, int frameNumber) {
+        ProfileScope scope(STAGE_SINK);
+        int slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            slotFreed.wait(lock, [this] { return !freeSlots.empty(); });
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        for (int y = 0; y < fb.height; y++)
+            std::memcpy(slots[slot].pixels.data() + size_t(y) * fb.width, fb.color.data() + size_t(y) * fb.stride,
+                        fb.width * sizeof(uint32_t));
+        slots[slot].frameNumber = frameNumber;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued.push_back(slot);
+        }
+        frameQueued.notify_one();
+    }
+
+    void encodeLoop() {
+        while (true) {
+            int slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frameQueued.wait(lock, [this] { return stopping || !queued.empty(); });
+                if (queued.empty()) return;
+                slot = queued.front();
+                queued.pop_front();
+            }
+            {
+                ProfileScope scope(STAGE_ENCODE);
+                encode(slots[slot]);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                freeSlots.push_back(slot);
+            }
+            slotFreed.notify_one();
+        }
+    }
+
+    // Encodes everything still queued, then stops the encoder threads.
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        frameQueued.notify_all();
+        for (auto &w : workers) w.join();
+        workers.clear();
+        for (auto &s : slots) SDL_FreeSurface(s.surface);
+        slots.clear();
+        freeSlots.clear();
+        stopping = false;
+    }
+
+    ~FrameEncoder() { finish(); }
+};
+
+inline int encoderThreads = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+// ---------- FRAME SINKS ----------
+// Where finished frames go. write() is called on the render thread with the
+// frame still in the framebuffer; sinks copy it and return. A sink that
+// could not open its output or lost a frame sets failed, which the batch
+// turns into its exit status.
+struct FrameSink {
+    std::atomic<bool> failed{false};
+
+    virtual ~FrameSink() {}
+    virtual void write(const Framebuffer &fb, int frameNumber) = 0;
+    virtual void finish() {}
+};
+
+// One file per frame in frames/, encoded on encoderThreads threads
+struct ImageSequenceSink : FrameSink {
+    FrameEncoder encoder;
+
+    ImageSequenceSink(bool png, int width, int height) {
+        ensureFolder("frames");
+        if (png)
+            encoder.start(width, height, encoderThreads, 2 * encoderThreads,
+                          [this](FrameEncoder::Slot &s) { if (!saveFramePNG(s.surface, s.frameNumber)) failed = true; });
+        else
+            encoder.start(width, height, encoderThreads, 2 * encoderThreads,
+                          [this](FrameEncoder::Slot &s) {
+                              if (!saveFramePPM(s.pixels.data(), s.width, s.height, s.frameNumber)) failed = true;
+                          });
+    }
+    void write(const Framebuffer &fb, int frameNumber) override { encoder.submit(fb, frameNumber); }
+    void finish() override { encoder.finish(); }
+};
+
+// A single Y4M (4:4:4) or raw RGBA stream to a file or stdout ("-"), e.g.
+//   ./main --headless --sink y4m --out - | ffmpeg -i - out.mp4
+// One encoder thread keeps frames in order; each frame is one fwrite.
+struct StreamSink : FrameSink {
+    FILE* out = nullptr;
+    bool y4m;
+    std::vector<uint8_t> bytes;
+    FrameEncoder encoder;
+
+    StreamSink(const std::string &path, bool y4mFormat, int width, int height) : y4m(y4mFormat) {
+        if (path == "-") {
+            out = stdout;
+#if defined(_WIN32)
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        } else {
+            out = std::fopen(path.c_str(), "wb");
+        }
+        if (!out) {
+            std::cerr << "Failed to open output stream: " << path << "\n";
+            failed = true;
+            return;
+        }
+        if (y4m)
+            std::fprintf(out, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n", width, height);
+        encoder.start(width, height, 1, 3, [this](FrameEncoder::Slot &s) { writeFrame(s.pixels.data(), s.width * s.height); });
+    }
+
+    void writeFrame(const uint32_t* frame, int n) {
+        if (y4m) {
+            // BT.601 studio range, full-resolution chroma
+            bytes.resize(6 + 3 * n);
+            std::memcpy(bytes.data(), "FRAME\n", 6);
+            uint8_t* Y = bytes.data() + 6;
+            uint8_t* U = Y + n;
+            uint8_t* V = U + n;
+            for (int i = 0; i < n; i++) {
+                int r = (frame[i] >> 16) & 0xFF, g = (frame[i] >> 8) & 0xFF, b = frame[i] & 0xFF;
+                Y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+                U[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                V[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+            }
+        } else {
+            bytes.resize(4 * n);
+            for (int i = 0; i < n; i++) {
+                bytes[4 * i + 0] = (frame[i] >> 16) & 0xFF;
+                bytes[4 * i + 1] = (frame[i] >> 8) & 0xFF;
+                bytes[4 * i + 2] = frame[i] & 0xFF;
+                bytes[4 * i + 3] = frame[i] >> 24;
+            }
+        }
+        if (std::fwrite(bytes.data(), 1, bytes.size(), out) != bytes.size()) {
+            std::cerr << "Failed to write frame to output stream\n";
+            failed = true;
+        }
+    }
+
+    void write(const Framebuffer &fb, int frameNumber) override {
+        if (out) encoder.submit(fb, frameNumber);
+    }
+    void finish() override {
+        encoder.finish();
+        if (out && (out == stdout ? std::fflush(out) : std::fclose(out)) != 0) failed = true;
+        out = nullptr;
+    }
+    ~StreamSink() { finish(); }
+};
+
+// format is png, ppm, y4m or raw; out is only used by the stream formats.
+// Every frame written must be width x height. nullptr if the format is
+// unknown or its output cannot be opened.
+inline std::unique_ptr<FrameSink> makeFrameSink(const std::string &format, const std::string &out, int width, int height) {
+    std::unique_ptr<FrameSink> sink;
+    if (format == "png") sink = std::make_unique<ImageSequenceSink>(true, width, height);
+    else if (format == "ppm") sink = std::make_unique<ImageSequenceSink>(false, width, height);
+    else if (format == "y4m") sink = std::make_unique<StreamSink>(out.empty() ? "frames.y4m" : out, true, width, height);
+    else if (format == "raw") sink = std::make_unique<StreamSink>(out.empty() ? "frames.rgba" : out, false, width, height);
+    else std::cerr << "Unknown frame sink: " << format << " (expected png, ppm, y4m or raw)\n";
+    if (sink && sink->failed) sink.reset();
+    return sink;
+}
+
+inline std::unique_ptr<FrameSink> frameSink;
+
+// ============================================================
+// ==================== YOUR ORIGINAL CODE =====================
+// ============================================================
+
+struct Material {
+    std::string name;
+    glm::vec3 Kd{1.0f,1.0f,1.0f};
+    std::string map_Kd;          // diffuse texture path, resolved against the MTL's folder
+    int texture = -1;            // index into textures
+    bool textured = false;
+    bool cullBackfaces = true;   // false for open, single-sheet surfaces seen from both sides
+};
+
+struct Model {
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec2> texcoords;             // vt records
+    std::vector<glm::vec3> normals;               // vn records
+    // Per-face attributes: parallel arrays, all indexed by face number
+    std::vector<std::array<int,3>> faces;
+    std::vector<uint32_t> faceMaterials;          // index into materials
+    std::vector<std::array<glm::vec2,3>> faceUVs; // texture UVs, zero for untextured faces
+    std::vector<std::array<int,3>> faceTexcoords; // 1-based vt per corner, 0 if absent
+    std::vector<std::array<int,3>> faceNormals;   // 1-based vn per corner, 0 if absent
+    std::vector<Material> materials;              // flat table in order of first use
+    std::string mtllib;                           // resolved MTL path, empty if none
+    glm::vec3 boundsMin{0.0f}, boundsMax{0.0f};   // vertex bounds, kept current by centerModel
+    std::vector<glm::vec3> vertexNormals;         // area-independent, for Gouraud shading
+    // Simplified copies, finest first (see buildLODs). They carry only what
+    // drawing reads: no vt/vn records, faceTexcoords or faceNormals.
+    std::vector<Model> lods;
+    std::vector<int> faceSources;                 // LODs only: the full model's face each face came from
+    std::vector<int> vertexSources;               // LODs only: the full model's vertex (0-based) for each vertex
+    float lodError = 0.0f;                        // LODs only: distance from the full model's surface
+};
+
+// Where one frame is seen from. centerModel fits scale to the framebuffer;
+// the keys, camera paths and the turntable move the rest.
+struct Camera {
+    float scale = 1.0f;
+    glm::vec2 panOffset{0.0f,0.0f};
+    float tiltOffset = 0.0f;
+    float orbitX = 0.0f;
+    float orbitY = 0.0f;
+};
+
+// Bumped by anything that changes what draw() would produce (camera, light,
+// shading settings). The interactive loop only draws, presents and saves a
+// frame when it has moved since the last one.
+inline uint64_t sceneRevision = 0;
+
+// Orthographic by default. The perspective camera sits on the +z axis looking
+// at the origin, at the distance where the origin keeps the orthographic
+// scale, so zooming moves the camera in and out.
+enum Projection { PROJECTION_ORTHO, PROJECTION_PERSPECTIVE };
+inline Projection projection = PROJECTION_ORTHO;
+inline float fieldOfView = 60.0f;                   // vertical, degrees
+inline float nearPlane = 0.1f, farPlane = 1000.0f;  // perspective clip distances from the camera
+
+inline glm::vec3 lightPos(0.0f,6.4f,1.0f);
+inline float ambientLight = 0.2f;
+
+// Flat lights each face from its normal, shadowed adds a shadow test to
+// that, and Gouraud lights the vertices and interpolates between them (also
+// shadowed). Fixed for a frame, so each mode gets its own pixel loop.
+enum ShadingMode { SHADING_FLAT, SHADING_SHADOWED, SHADING_GOURAUD, SHADING_MODE_COUNT };
+inline const char* shadingModeNames[SHADING_MODE_COUNT] = { "flat", "shadowed", "gouraud" };
+inline ShadingMode shadingMode = SHADING_FLAT;
+
+// ---------- TEXTURES ----------
+// Each texture is converted once at load into a mip chain of texels packed
+// like the framebuffer (ARGB). Levels are stored in 4x4 texel tiles, one cache
+// line each, so a bilinear footprint, or a run of samples walking across an
+// oblique floor, touches a line or two rather than one row per texel.
+// Filtering works on the packed texels and converts to float once per sample.
+enum TextureFilter { FILTER_NEAREST, FILTER_BILINEAR, FILTER_TRILINEAR };
+inline const char* textureFilterNames[] = { "nearest", "bilinear", "trilinear" };
+inline TextureFilter textureFilter = FILTER_TRILINEAR;
+
+struct TextureLevel {
+    int w, h;
+    int tilesX;                     // 4x4 tiles per row
+    std::vector<uint32_t> texels;   // tile after tile, each row-major
+};
+
+struct Texture {
+    std::string path;
+    bool wrap;                          // repeat outside [0,1] instead of clamping
+    std::vector<TextureLevel> levels;   // full size first, then halved down to 1x1
+};
+
+inline std::vector<Texture> textures;
+inline int floorTexture = -1;   // ground.png, for a "Floor" material without map_Kd
+
+inline size_t texelIndex(const TextureLevel &l,int x,int y){
+    return (size_t((y>>2)*l.tilesX + (x>>2))<<4) | ((y&3)<<2) | (x&3);
+}
+
+inline TextureLevel makeTextureLevel(int w,int h){
+    TextureLevel l;
+    l.w = w; l.h = h;
+    l.tilesX = (w+3)/4;
+    l.texels.assign(size_t(l.tilesX)*((h+3)/4)*16, 0u);
+    return l;
+}
+
+// Blends packed colors a and b by f/256, all channels but alpha at once
+inline uint32_t lerpTexel(uint32_t a,uint32_t b,uint32_t f){
+    uint32_t rb = (((a&0xFF00FFu)*(256-f) + (b&0xFF00FFu)*f)>>8) & 0xFF00FFu;
+    uint32_t g  = (((a&0x00FF00u)*(256-f) + (b&0x00FF00u)*f)>>8) & 0x00FF00u;
+    return rb | g;
+}
+
+// Loads path once and returns its index in textures, or -1 if it can't be read
+inline int loadTexture(const std::string &path,bool wrap){
+    for(size_t i=0;i<textures.size();i++)
+        if(textures[i].path==path) return int(i);
+    SDL_Surface* loaded = IMG_Load(path.c_str());
+    if(!loaded){
+        std::cerr << "Failed to load texture: " << path << std::endl;
+        return -1;
+    }
+    SDL_Surface* surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(loaded);
+    if(!surface || surface->w<=0 || surface->h<=0){
+        std::cerr << "Failed to convert texture: " << path << std::endl;
+        if(surface) SDL_FreeSurface(surface);
+        return -1;
+    }
+
+    Texture tex;
+    tex.path = path;
+    tex.wrap = wrap;
+    tex.levels.push_back(makeTextureLevel(surface->w, surface->h));
+    TextureLevel &base = tex.levels[0];
+    for(int y=0;y<base.h;y++){
+        const uint32_t* row = (const uint32_t*)((const uint8_t*)surface->pixels + size_t(y)*surface->pitch);
+        for(int x=0;x<base.w;x++) base.texels[texelIndex(base,x,y)] = row[x];
+    }
+    SDL_FreeSurface(surface);
+
+    // Each level is the 2x2 box filter of the one above; odd edges repeat their last texel
+    while(tex.levels.back().w>1 || tex.levels.back().h>1){
+        const TextureLevel &src = tex.levels.back();
+        TextureLevel dst = makeTextureLevel(std::max(1,src.w/2), std::max(1,src.h/2));
+        for(int y=0;y<dst.h;y++)
+            for(int x=0;x<dst.w;x++){
+                int x0 = std::min(2*x,src.w-1), x1 = std::min(2*x+1,src.w-1);
+                int y0 = std::min(2*y,src.h-1), y1 = std::min(2*y+1,src.h-1);
+                uint32_t p[4] = { src.texels[texelIndex(src,x0,y0)], src.texels[texelIndex(src,x1,y0)],
+                                  src.texels[texelIndex(src,x0,y1)], src.texels[texelIndex(src,x1,y1)] };
+                uint32_t c = 0xFF000000u;
+                for(int shift=0; shift<24; shift+=8){
+                    uint32_t sum = 2;
+                    for(uint32_t v : p) sum += (v>>shift)&0xFF;
+                    c |= (sum>>2)<<shift;
+                }
+                dst.texels[texelIndex(dst,x,y)] = c;
+            }
+        tex.levels.push_back(std::move(dst));
+    }
+
+    textures.push_back(std::move(tex));
+    return int(textures.size()-1);
+}
+
+inline int texelCoord(int i,int n,bool wrap){
+    return wrap ? ((i%n)+n)%n : std::clamp(i,0,n-1);
+}
+
+// Packed texel at uv from one level; v runs up the image
+inline uint32_t sampleLevel(const Texture &tex,int level,const glm::vec2 &uv,bool bilinear){
+    const TextureLevel &l = tex.levels[level];
+    float fx = uv.x*l.w, fy = (1.0f-uv.y)*l.h;
+    if(!bilinear)
+        return l.texels[texelIndex(l, texelCoord(int(fx),l.w,tex.wrap), texelCoord(int(fy),l.h,tex.wrap))];
+
+    fx -= 0.5f; fy -= 0.5f;
+    float x0 = std::floor(fx), y0 = std::floor(fy);
+    uint32_t wx = uint32_t((fx-x0)*256.0f), wy = uint32_t((fy-y0)*256.0f);
+    int xa = texelCoord(int(x0),l.w,tex.wrap), xb = texelCoord(int(x0)+1,l.w,tex.wrap);
+    int ya = texelCoord(int(y0),l.h,tex.wrap), yb = texelCoord(int(y0)+1,l.h,tex.wrap);
+    uint32_t top    = lerpTexel(l.texels[texelIndex(l,xa,ya)], l.texels[texelIndex(l,xb,ya)], wx);
+    uint32_t bottom = lerpTexel(l.texels[texelIndex(l,xa,yb)], l.texels[texelIndex(l,xb,yb)], wx);
+    return lerpTexel(top, bottom, wy);
+}
+
+// Mip level for a pixel whose UVs move by ddx and ddy to the next pixel
+// across and down: log2 of the larger step, in level-0 texels
+inline float textureLod(int texture,const glm::vec2 &ddx,const glm::vec2 &ddy){
+    if(texture<0) return 0.0f;
+    glm::vec2 size(textures[texture].levels[0].w, textures[texture].levels[0].h);
+    float rho = std::max(glm::length(ddx*size), glm::length(ddy*size));
+    return rho>1.0f ? std::log2(rho) : 0.0f;
+}
+
+// Filtered color of texture at uv, white when the texture failed to load
+inline glm::vec3 sampleTexture(int texture,glm::vec2 uv,float lod){
+    if(texture<0) return glm::vec3(1.0f,1.0f,1.0f);
+    profileCounts[COUNTER_TEXTURE_SAMPLES]++;
+    const Texture &tex = textures[texture];
+    if(tex.wrap) uv -= glm::floor(uv);
+    else uv = glm::vec2(std::clamp(uv.x,0.0f,1.0f), std::clamp(uv.y,0.0f,1.0f));
+
+    int last = int(tex.levels.size())-1;
+    uint32_t px;
+    if(textureFilter==FILTER_NEAREST)
+        px = sampleLevel(tex, 0, uv, false);
+    else if(textureFilter==FILTER_BILINEAR)
+        px = sampleLevel(tex, std::min(int(lod+0.5f),last), uv, true);
+    else{
+        int level = std::min(int(lod),last);
+        px = sampleLevel(tex, level, uv, true);
+        if(level<last)
+            px = lerpTexel(px, sampleLevel(tex, level+1, uv, true), uint32_t((lod-level)*256.0f));
+    }
+    return glm::vec3((px>>16)&0xFF, (px>>8)&0xFF, px&0xFF)/255.0f;
+}
+
+// ---------- PARALLEL HELPER ----------
+// parallelFor runs fn(0..count-1) on the calling thread plus up to
+// rasterThreads-1 pool workers, all pulling indices from a shared counter.
+// The workers are started once, by setThreadCount (or the first parallelFor
+// that needs them), and sleep on a condition variable between jobs, so a frame's
+// several parallelFor calls cost a wake-up each rather than a thread start.
+inline int rasterThreads = std::max(1u, std::thread::hardware_concurrency());
+
+// Set on threads that each draw whole frames (see the frame-parallel batch);
+// their parallelFor calls run inline instead of using the pool. Pool workers,
+// and a caller while it runs a job, have it set too, so a nested parallelFor
+// runs inline rather than waiting on the pool it is part of.
+inline thread_local bool frameWorker = false;
+
+struct WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex jobMutex;                 // one job at a time
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    uint64_t generation = 0;             // bumped for every job
+    bool stopping = false;
+    void (*run)(void*,int) = nullptr;    // the job: run(context, index)
+    void* context = nullptr;
+    int count = 0;
+    int helpers = 0, joined = 0, active = 0;
+    std::atomic<int> next{0};
+
+    void runIndices(){
+        for(int i=next++; i<count; i=next++) run(context, i);
+        flushProfileCounters();
+    }
+
+    void workerLoop(){
+        frameWorker = true;
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true){
+            wake.wait(lock, [&]{ return stopping || generation!=seen; });
+            if(stopping) return;
+            seen = generation;
+            if(joined>=helpers) continue;
+            joined++; active++;
+            lock.unlock();
+            runIndices();
+            lock.lock();
+            if(--active==0) done.notify_all();
+        }
+    }
+
+    void start(int workers){
+        stop();
+        for(int i=0;i<workers;i++) threads.emplace_back([this]{ workerLoop(); });
+    }
+
+    void stop(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto &t : threads) t.join();
+        threads.clear();
+        stopping = false;
+    }
+
+    // Runs run(context, 0..n-1) here and on up to helperCount workers.
+    // Workers that wake after the caller ran out of indices do not join,
+    // and the caller waits for those that did, so context outlives the job.
+    void parallel(int n,int helperCount,void (*fn)(void*,int),void* ctx){
+        std::lock_guard<std::mutex> job(jobMutex);
+        if(threads.size()<size_t(helperCount)) start(rasterThreads-1);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            run = fn; context = ctx; count = n;
+            next = 0;
+            helpers = helperCount; joined = 0;
+            generation++;
+        }
+        wake.notify_all();
+        frameWorker = true;
+        runIndices();
+        frameWorker = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        helpers = joined;
+        done.wait(lock, [&]{ return active==0; });
+    }
+
+    ~WorkerPool(){ stop(); }
+};
+
+inline WorkerPool workerPool;
+
+// Sets the number of threads parallelFor uses (at least 1) and restarts the
+// pool with that many less one: the calling thread is the last.
+inline void setThreadCount(int threads){
+    std::lock_guard<std::mutex> job(workerPool.jobMutex);
+    rasterThreads = std::max(1, threads);
+    workerPool.start(rasterThreads-1);
+}
+
+template<typename Fn>
+void parallelFor(int count, Fn fn){
+    int threads = frameWorker ? 1 : std::min(rasterThreads, count);
+    if(threads<=1){
+        for(int i=0;i<count;i++) fn(i);
+        return;
+    }
+    workerPool.parallel(count, threads-1, [](void* f,int i){ (*static_cast<Fn*>(f))(i); }, &fn);
+}
+
+// ---------- MAPPED FILE ----------
+// Read-only view of a whole file: mmap where available, one read otherwise.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    std::vector<char> buffer;
+    void* mapping = nullptr;
+
+    bool open(const std::string &path){
+#if !defined(_WIN32)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd<0) return false;
+        struct stat st;
+        if(fstat(fd,&st)!=0){ ::close(fd); return false; }
+        size = st.st_size;
+        if(size>0){
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapping==MAP_FAILED){ mapping = nullptr; ::close(fd); return false; }
+            madvise(mapping, size, MADV_SEQUENTIAL);
+            data = (const char*)mapping;
+        }
+        ::close(fd);
+        return true;
+#else
+        std::ifstream file(path, std::ios::binary);
+        if(!file.is_open()) return false;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = buffer.data(); size = buffer.size();
+        return true;
+#endif
+    }
+
+    ~MappedFile(){
+#if !defined(_WIN32)
+        if(mapping) munmap(mapping, size);
+#endif
+    }
+};
+
+// ---------- TEXT SCANNING ----------
+// Zero-copy helpers over [p,end): nothing is allocated per line or per number.
+inline const char* skipBlanks(const char* p,const char* end){
+    while(p<end && (*p==' ' || *p=='\t')) p++;
+    return p;
+}
+
+inline const char* findLineEnd(const char* p,const char* end){
+    const char* e = (const char*)std::memchr(p, '\n', end-p);
+    return e ? e : end;
+}
+
+// On malformed input the value is left at 0 and p is not advanced
+inline const char* parseFloat(const char* p,const char* end,float &value){
+    p = skipBlanks(p,end);
+    if(p<end && *p=='+') p++;
+    auto r = std::from_chars(p, end, value);
+    if(r.ec!=std::errc()){ value = 0.0f; return p; }
+    return r.ptr;
+}
+
+inline const char* parseInt(const char* p,const char* end,int &value){
+    if(p<end && *p=='+') p++;
+    auto r = std::from_chars(p, end, value);
+    if(r.ec!=std::errc()){ value = 0; return p; }
+    return r.ptr;
+}
+
+// Rest of the line with surrounding whitespace (and a CR) trimmed
+inline std::string lineName(const char* p,const char* end){
+    p = skipBlanks(p,end);
+    while(end>p && (end[-1]==' ' || end[-1]=='\t' || end[-1]=='\r')) end--;
+    return std::string(p,end);
+}
+
+// True if the line starts with keyword followed by a blank; p moves past both
+inline bool lineKeyword(const char* &p,const char* end,const char* keyword){
+    size_t n = std::strlen(keyword);
+    if(size_t(end-p)<=n || std::memcmp(p,keyword,n)!=0 || (p[n]!=' ' && p[n]!='\t')) return false;
+    p += n+1;
+    return true;
+}
+
+// ---------- load MTL ----------
+inline std::map<std::string,Material> loadMTL(const std::string &filename){
+    std::map<std::string,Material> materials;
+    MappedFile file;
+    if(!file.open(filename)){ std::cerr << "Failed to open MTL: " << filename << std::endl; return materials; }
+    std::string currentMaterial;
+    std::string dir = filename.substr(0, filename.find_last_of("/\\")+1);
+    const char* end = file.data+file.size;
+    for(const char* line=file.data; line<end; ){
+        const char* e = findLineEnd(line,end);
+        const char* p = skipBlanks(line,e);
+        if(lineKeyword(p,e,"newmtl")){ currentMaterial = lineName(p,e); materials[currentMaterial] = Material{}; }
+        else if(lineKeyword(p,e,"Kd")){
+            glm::vec3 kd;
+            p = parseFloat(p,e,kd.r); p = parseFloat(p,e,kd.g); p = parseFloat(p,e,kd.b);
+            materials[currentMaterial].Kd = kd;
+        }
+        else if(lineKeyword(p,e,"map_Kd")){
+            // Options such as -s or -o come first; the file name is last
+            std::string path = lineName(p,e);
+            if(!path.empty() && path[0]=='-') path = path.substr(path.find_last_of(" \t")+1);
+            materials[currentMaterial].map_Kd = dir+path;
+        }
+        line = e+1;
+    }
+    return materials;
+}
+
+// Returns name's slot in model.materials, adding it with its colour from
+// library on first use. Only runs per usemtl switch, so a linear scan is fine.
+inline uint32_t internMaterial(Model &model,const std::map<std::string,Material> &library,const std::string &name){
+    for(uint32_t i=0;i<model.materials.size();i++)
+        if(model.materials[i].name==name) return i;
+    Material m;
+    auto it = library.find(name);
+    if(it!=library.end()) m = it->second;
+    m.name = name;
+    // The floor falls back to ground.png and stays textured (white) without it
+    m.texture = !m.map_Kd.empty() ? loadTexture(m.map_Kd, true) : name=="Floor" ? floorTexture : -1;
+    m.textured = m.texture>=0 || name=="Floor";
+    m.cullBackfaces = name!="Floor"; // the floor is one sheet, visible from below too
+    model.materials.push_back(m);
+    return uint32_t(model.materials.size()-1);
+}
+
+inline void computeBoundingBox(const Model &model, glm::vec3 &minV, glm::vec3 &maxV){
+    if(model.vertices.empty()) return;
+    minV=maxV=model.vertices[0];
+    for(const auto &v:model.vertices){
+        minV = glm::min(minV,v);
+        maxV = glm::max(maxV,v);
+    }
+}
+
+// Area-independent average of the face normals around each vertex, for Gouraud shading
+inline void computeVertexNormals(Model &model){
+    model.vertexNormals.resize(model.vertices.size(), glm::vec3(0.0f));
+    for(size_t i=0;i<model.faces.size();i++){
+        const auto &f = model.faces[i];
+        glm::vec3 v0 = model.vertices[f[0]-1];
+        glm::vec3 v1 = model.vertices[f[1]-1];
+        glm::vec3 v2 = model.vertices[f[2]-1];
+        glm::vec3 n = glm::normalize(glm::cross(v1-v0, v2-v0));
+        model.vertexNormals[f[0]-1] += n;
+        model.vertexNormals[f[1]-1] += n;
+        model.vertexNormals[f[2]-1] += n;
+    }
+    for(auto &vn : model.vertexNormals) vn = glm::normalize(vn);
+}
+
+// ---------- load OBJ ----------
+// The file is split into chunks at line boundaries. Pass 1 counts v/vt/vn
+// records and the last usemtl of every chunk so each chunk knows its index
+// bases (for negative indices) and starting material; pass 2 parses the
+// chunks independently. Both passes run in parallel on large files.
+struct ObjChunk {
+    const char* begin = nullptr;
+    const char* end = nullptr;
+    int vertexCount = 0, texcoordCount = 0, normalCount = 0;
+    int vertexBase = 0, texcoordBase = 0, normalBase = 0;
+    bool setsMaterial = false;
+    std::string lastMaterial, startMaterial, mtllib;
+
+    std::vector<glm::vec3> vertices, normals;
+    std::vector<glm::vec2> texcoords;
+    std::vector<std::array<int,3>> faces, faceTexcoords, faceNormals;
+    std::vector<std::pair<size_t,std::string>> materialRuns; // first local face, material
+};
+
+enum ObjRecord { OBJ_OTHER, OBJ_VERTEX, OBJ_TEXCOORD, OBJ_NORMAL, OBJ_FACE, OBJ_USEMTL, OBJ_MTLLIB };
+
+inline ObjRecord objRecord(const char* &p,const char* end){
+    p = skipBlanks(p,end);
+    if(p>=end) return OBJ_OTHER;
+    if(*p=='v'){
+        if(lineKeyword(p,end,"v")) return OBJ_VERTEX;
+        if(lineKeyword(p,end,"vt")) return OBJ_TEXCOORD;
+        if(lineKeyword(p,end,"vn")) return OBJ_NORMAL;
+    }
+    else if(*p=='f'){ if(lineKeyword(p,end,"f")) return OBJ_FACE; }
+    else if(lineKeyword(p,end,"usemtl")) return OBJ_USEMTL;
+    else if(lineKeyword(p,end,"mtllib")) return OBJ_MTLLIB;
+    return OBJ_OTHER;
+}
+
+inline void countObjChunk(ObjChunk &c){
+    for(const char* line=c.begin; line<c.end; ){
+        const char* e = findLineEnd(line,c.end);
+        const char* p = line;
+        switch(objRecord(p,e)){
+            case OBJ_VERTEX:   c.vertexCount++; break;
+            case OBJ_TEXCOORD: c.texcoordCount++; break;
+            case OBJ_NORMAL:   c.normalCount++; break;
+            case OBJ_USEMTL:   c.setsMaterial = true; c.lastMaterial = lineName(p,e); break;
+            default: break;
+        }
+        line = e+1;
+    }
+}
+
+inline void parseObjChunk(ObjChunk &c){
+    c.vertices.reserve(c.vertexCount);
+    c.texcoords.reserve(c.texcoordCount);
+    c.normals.reserve(c.normalCount);
+    c.materialRuns.push_back({0, c.startMaterial});
+
+    // OBJ indices are 1-based; negative ones count back from the latest record
+    auto resolve = [](int index,int base,int localCount){
+        return index<0 ? base+localCount+1+index : index;
+    };
+
+    std::vector<std::array<int,3>> polygon; // v, vt, vn per corner
+    for(const char* line=c.begin; line<c.end; ){
+        const char* e = findLineEnd(line,c.end);
+        const char* p = line;
+        switch(objRecord(p,e)){
+            case OBJ_VERTEX: {
+                glm::vec3 v;
+                p = parseFloat(p,e,v.x); p = parseFloat(p,e,v.y); p = parseFloat(p,e,v.z);
+                c.vertices.push_back(v);
+                break;
+            }
+            case OBJ_TEXCOORD: {
+                glm::vec2 t;
+                p = parseFloat(p,e,t.x); p = parseFloat(p,e,t.y);
+                c.texcoords.push_back(t);
+                break;
+            }
+            case OBJ_NORMAL: {
+                glm::vec3 n;
+                p = parseFloat(p,e,n.x); p = parseFloat(p,e,n.y); p = parseFloat(p,e,n.z);
+                c.normals.push_back(n);
+                break;
+            }
+            case OBJ_FACE: {
+                polygon.clear();
+                while(true){
+                    p = skipBlanks(p,e);
+                    if(p>=e || *p=='\r' || *p=='#') break;
+                    int v=0, vt=0, vn=0;
+                    const char* start = p;
+                    p = parseInt(p,e,v);
+                    if(p==start) break;
+                    if(p<e && *p=='/'){
+                        p++;
+                        if(p<e && *p!='/') p = parseInt(p,e,vt);
+                        if(p<e && *p=='/'){ p++; p = parseInt(p,e,vn); }
+                    }
+                    polygon.push_back({ resolve(v, c.vertexBase, c.vertices.size()),
+                                        vt ? resolve(vt, c.texcoordBase, c.texcoords.size()) : 0,
+                                        vn ? resolve(vn, c.normalBase, c.normals.size()) : 0 });
+                    while(p<e && *p!=' ' && *p!='\t' && *p!='\r') p++;
+                }
+                // Fan-triangulate polygons
+                for(size_t i=1;i+1<polygon.size();i++){
+                    c.faces.push_back({ polygon[0][0], polygon[i][0], polygon[i+1][0] });
+                    c.faceTexcoords.push_back({ polygon[0][1], polygon[i][1], polygon[i+1][1] });
+                    c.faceNormals.push_back({ polygon[0][2], polygon[i][2], polygon[i+1][2] });
+                }
+                break;
+            }
+            case OBJ_USEMTL:
+                c.materialRuns.push_back({c.faces.size(), lineName(p,e)});
+                break;
+            case OBJ_MTLLIB:
+                c.mtllib = lineName(p,e);
+                break;
+            default: break;
+        }
+        line = e+1;
+    }
+}
+
+inline Model loadOBJ(const std::string &filename){
+    Model model;
+    MappedFile file;
+    if(!file.open(filename)){ std::cerr << "Failed to open OBJ: " << filename << std::endl; exit(1); }
+    Uint64 start = SDL_GetPerformanceCounter();
+    std::string dir = filename.substr(0, filename.find_last_of("/\\")+1);
+
+    // One chunk for small files; several per thread for big ones to balance load
+    int chunkCount = (file.size>(8u<<20) && rasterThreads>1) ? rasterThreads*4 : 1;
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char* end = file.data+file.size;
+    const char* p = file.data;
+    for(int i=0;i<chunkCount;i++){
+        chunks[i].begin = p;
+        if(i==chunkCount-1) p = end;
+        else{
+            p = std::max(p, file.data + file.size*(i+1)/chunkCount);
+            p = p<end ? findLineEnd(p,end) : end;
+            if(p<end) p++;
+        }
+        chunks[i].end = p;
+    }
+
+    parallelFor(chunkCount, [&](int i){ countObjChunk(chunks[i]); });
+
+    std::string material;
+    for(int i=0;i<chunkCount;i++){
+        ObjChunk &c = chunks[i];
+        if(i>0){
+            const ObjChunk &prev = chunks[i-1];
+            c.vertexBase = prev.vertexBase+prev.vertexCount;
+            c.texcoordBase = prev.texcoordBase+prev.texcoordCount;
+            c.normalBase = prev.normalBase+prev.normalCount;
+        }
+        c.startMaterial = material;
+        if(c.setsMaterial) material = c.lastMaterial;
+    }
+
+    parallelFor(chunkCount, [&](int i){ parseObjChunk(chunks[i]); });
+
+    // Merge in file order
+    size_t vertexTotal=0, texcoordTotal=0, normalTotal=0, faceTotal=0;
+    for(const auto &c : chunks){
+        vertexTotal += c.vertices.size(); texcoordTotal += c.texcoords.size();
+        normalTotal += c.normals.size(); faceTotal += c.faces.size();
+    }
+    model.vertices.reserve(vertexTotal); model.texcoords.reserve(texcoordTotal);
+    model.normals.reserve(normalTotal);
+    model.faces.reserve(faceTotal); model.faceTexcoords.reserve(faceTotal);
+    model.faceNormals.reserve(faceTotal); model.faceMaterials.reserve(faceTotal);
+    std::string mtllib;
+    for(const auto &c : chunks) if(!c.mtllib.empty()) mtllib = c.mtllib;
+    std::map<std::string,Material> library;
+    if(!mtllib.empty()){
+        model.mtllib = dir+mtllib;
+        library = loadMTL(model.mtllib);
+    }
+
+    size_t skippedFaces = 0;
+    for(auto &c : chunks){
+        model.vertices.insert(model.vertices.end(), c.vertices.begin(), c.vertices.end());
+        model.texcoords.insert(model.texcoords.end(), c.texcoords.begin(), c.texcoords.end());
+        model.normals.insert(model.normals.end(), c.normals.begin(), c.normals.end());
+        for(size_t r=0;r<c.materialRuns.size();r++){
+            size_t runEnd = r+1<c.materialRuns.size() ? c.materialRuns[r+1].first : c.faces.size();
+            uint32_t material = internMaterial(model, library, c.materialRuns[r].second);
+            for(size_t f=c.materialRuns[r].first; f<runEnd; f++){
+                const auto &face = c.faces[f];
+                bool valid = true;
+                for(int k=0;k<3;k++) valid = valid && face[k]>=1 && face[k]<=int(vertexTotal);
+                if(!valid){ skippedFaces++; continue; }
+                model.faces.push_back(face);
+                model.faceTexcoords.push_back(c.faceTexcoords[f]);
+                model.faceNormals.push_back(c.faceNormals[f]);
+                model.faceMaterials.push_back(material);
+            }
+        }
+        c = ObjChunk{};
+    }
+
+    if(skippedFaces) std::cerr << "Skipped " << skippedFaces << " faces with bad vertex indices in " << filename << "\n";
+
+    computeBoundingBox(model,model.boundsMin,model.boundsMax);
+
+    auto normalizeUV = [](float x,float z){
+        float u = (x+3.0f)/6.0f;
+        float v = (z+2.0f)/6.0f;
+        return glm::vec2(u,v);
+    };
+
+    // map_Kd textures use the file's vt coordinates, the floor a planar
+    // projection onto x/z
+    model.faceUVs.assign(model.faces.size(), {});
+    for(size_t i=0;i<model.faces.size();i++){
+        const Material &material = model.materials[model.faceMaterials[i]];
+        if(!material.textured) continue;
+        const auto &tc = model.faceTexcoords[i];
+        bool mapped = !material.map_Kd.empty();
+        for(int k=0;k<3;k++) mapped = mapped && tc[k]>=1 && tc[k]<=int(model.texcoords.size());
+        if(mapped){
+            model.faceUVs[i] = { model.texcoords[tc[0]-1], model.texcoords[tc[1]-1], model.texcoords[tc[2]-1] };
+            continue;
+        }
+        const auto &f = model.faces[i];
+        glm::vec3 v0=model.vertices[f[0]-1];
+        glm::vec3 v1=model.vertices[f[1]-1];
+        glm::vec3 v2=model.vertices[f[2]-1];
+        model.faceUVs[i]={
+            { normalizeUV(v0.x,v0.z),
+              normalizeUV(v1.x,v1.z),
+              normalizeUV(v2.x,v2.z) }
+        };
+    }
+
+    double ms = 1000.0*double(SDL_GetPerformanceCounter()-start)/SDL_GetPerformanceFrequency();
+    std::clog << "Loaded " << filename << ": " << model.vertices.size() << " vertices, "
+              << model.faces.size() << " faces in " << ms << " ms ("
+              << file.size/1048576.0/(ms/1000.0) << " MB/s, " << chunkCount << " chunks)\n";
+
+    computeVertexNormals(model);
+
+    return model;
+}
+
+// ---------- LEVELS OF DETAIL ----------
+// Quadric error simplification (Garland & Heckbert) run once at load. Each
+// collapse moves one vertex onto a neighbour (half-edge collapse), so every
+// surviving vertex keeps its original position and normal, and every
+// surviving face is an original face with the same material and UVs.
+// Vertices at the same position are welded into one for the topology, so a
+// closed surface that repeats vertices (a pole per slice, a split normal)
+// is still closed and both sides of such a seam move together.
+// Vertices on an open edge, a material edge, a UV seam or a seam between
+// welded vertices may only slide along that edge, weighted by a plane
+// across it so the outline holds its shape; vertices where such edges meet
+// or branch, or whose faces disagree on their UV or vertex, never move. Snapshots
+// taken at every halving of the face count form Model::lods, which draw()
+// picks from by projected size (selectLOD). Each halving first runs in
+// LOD_CHUNKS slabs of vertices in parallel, each collapsing only edges whose
+// faces lie wholly inside it, then finishes serially across the slab
+// boundaries, which move every level. The chain is stored in the mesh
+// cache, so it is only built when the cache is (re)written and LODs are
+// enabled; changing the LOD_ settings needs a MESH_CACHE_VERSION bump.
+#define LOD_MIN_FACES 512        // models below twice this get no LODs
+#define LOD_MAX_LEVELS 8
+#define LOD_CHUNKS 16            // fixed, so the result does not depend on the thread count
+#define LOD_MAX_ROUNDS 4         // parallel rounds per level before the serial pass
+#define LOD_BORDER_WEIGHT 10.0   // weight of the planes across border edges
+#define LOD_LENGTH_WEIGHT 1e-4   // tie-break for equal-error collapses, per length^4
+#define LOD_MIN_FLIP_DOT 0.2f    // smallest allowed cosine between a face's normal before and after
+
+inline bool lodEnabled = true;
+
+// One LOD face in terms of the full model: the face it came from, its
+// corners as 0-based full-model vertices and its UVs. LODs are kept in the
+// mesh cache in this form.
+struct LODFaceRecord {
+    int32_t source;
+    int32_t corners[3];
+    glm::vec2 uv[3];
+};
+
+// The faces as a Model of their own, with only the vertices they use.
+// faceSources and vertexSources map back to the full model.
+inline Model makeLOD(const Model &model,const std::vector<LODFaceRecord> &records,float error){
+    Model lod;
+    lod.lodError = error;
+    lod.materials = model.materials;
+    lod.mtllib = model.mtllib;
+    std::vector<int> remap(model.vertices.size(), 0);
+    lod.faces.reserve(records.size());
+    for(const auto &r : records){
+        std::array<int,3> face;
+        for(int k=0;k<3;k++){
+            int &index = remap[r.corners[k]];
+            if(!index){
+                lod.vertices.push_back(model.vertices[r.corners[k]]);
+                lod.vertexNormals.push_back(model.vertexNormals[r.corners[k]]);
+                lod.vertexSources.push_back(r.corners[k]);
+                index = lod.vertices.size();
+            }
+            face[k] = index;
+        }
+        lod.faces.push_back(face);
+        lod.faceMaterials.push_back(model.faceMaterials[r.source]);
+        lod.faceUVs.push_back({ r.uv[0], r.uv[1], r.uv[2] });
+        lod.faceSources.push_back(r.source);
+    }
+    computeBoundingBox(lod, lod.boundsMin, lod.boundsMax);
+    return lod;
+}
+
+// Sum of squared distances to a set of weighted planes, as the upper
+// triangle of the symmetric 4x4 matrix
+struct Quadric {
+    double q[10] = {};
+
+    void addPlane(double a,double b,double c,double d,double w){
+        q[0]+=w*a*a; q[1]+=w*a*b; q[2]+=w*a*c; q[3]+=w*a*d;
+        q[4]+=w*b*b; q[5]+=w*b*c; q[6]+=w*b*d;
+        q[7]+=w*c*c; q[8]+=w*c*d; q[9]+=w*d*d;
+    }
+    Quadric& operator+=(const Quadric &o){
+        for(int i=0;i<10;i++) q[i] += o.q[i];
+        return *this;
+    }
+    double error(const glm::vec3 &p) const {
+        double x=p.x, y=p.y, z=p.z;
+        return x*x*q[0] + 2*x*y*q[1] + 2*x*z*q[2] + 2*x*q[3]
+             + y*y*q[4] + 2*y*z*q[5] + 2*y*q[6]
+             + z*z*q[7] + 2*z*q[8] + q[9];
+    }
+};
+
+struct MeshSimplifier {
+    enum VertexKind { VERTEX_INTERIOR, VERTEX_BORDER, VERTEX_LOCKED };
+
+    // Queued with the cost at the time; an entry whose cost no longer
+    // matches is stale, and a fresh one was queued when the cost changed
+    struct Collapse {
+        double cost;
+        int from, to;
+        bool operator>(const Collapse &o) const { return cost>o.cost; }
+    };
+
+    typedef std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> Queue;
+
+    // Per-thread working space for valid() and collapse()
+    struct Scratch {
+        std::vector<int> shared, neighbours, fromNeighbours, toNeighbours;
+    };
+
+    const Model &model;
+    std::vector<int> weld;                           // per vertex: lowest vertex index at its position
+    std::vector<std::array<int,3>> faces;            // welded, updated as vertices collapse
+    std::vector<std::array<int,3>> sources;          // per corner: the 0-based model vertex it uses
+    std::vector<std::array<glm::vec2,3>> faceUVs;
+    std::vector<uint8_t> faceAlive;
+    size_t liveFaces;
+    std::vector<std::vector<int>> vertexFaces;       // faces around each vertex, may hold dead ones
+    std::vector<std::vector<int>> borderNeighbours;  // other ends of each vertex's border edges
+    std::vector<uint8_t> kind, vertexAlive;
+    std::vector<float> deviation;                    // bound on how far the vertices collapsed into each one now are from the surface
+    std::vector<Quadric> quadrics;
+    std::vector<int> byAxis;                         // welded vertices along the longest bounds axis
+    std::vector<int> chunk;                          // per vertex: its slab for the current level
+
+    explicit MeshSimplifier(const Model &m) : model(m) {
+        size_t vertexCount = model.vertices.size(), faceCount = model.faces.size();
+        weldVertices();
+        faces.resize(faceCount);
+        sources.resize(faceCount);
+        faceAlive.assign(faceCount, 1);
+        liveFaces = faceCount;
+        for(size_t f=0;f<faceCount;f++){
+            for(int k=0;k<3;k++){
+                sources[f][k] = model.faces[f][k]-1;
+                faces[f][k] = weld[sources[f][k]];
+            }
+            // Two corners at one position: no area, and no place in the topology
+            if(faces[f][0]==faces[f][1] || faces[f][1]==faces[f][2] || faces[f][2]==faces[f][0]){
+                faceAlive[f] = 0;
+                liveFaces--;
+            }
+        }
+        faceUVs = model.faceUVs;
+        vertexFaces.resize(vertexCount);
+        borderNeighbours.resize(vertexCount);
+        kind.assign(vertexCount, VERTEX_INTERIOR);
+        vertexAlive.resize(vertexCount);
+        for(size_t v=0;v<vertexCount;v++) vertexAlive[v] = weld[v]==int(v);
+        deviation.assign(vertexCount, 0.0f);
+        quadrics.resize(vertexCount);
+
+        for(size_t f=0;f<faceCount;f++){
+            if(!faceAlive[f]) continue;
+            for(int k=0;k<3;k++) vertexFaces[faces[f][k]].push_back(f);
+            glm::vec3 n = glm::cross(position(faces[f][1])-position(faces[f][0]), position(faces[f][2])-position(faces[f][0]));
+            double area = 0.5*glm::length(n);
+            if(area<=0.0) continue;
+            n = glm::normalize(n);
+            double d = -glm::dot(n, position(faces[f][0]));
+            for(int k=0;k<3;k++) quadrics[faces[f][k]].addPlane(n.x,n.y,n.z,d,area);
+        }
+        findEdges();
+
+        glm::vec3 extent = model.boundsMax-model.boundsMin;
+        int axis = extent.x>=extent.y && extent.x>=extent.z ? 0 : extent.y>=extent.z ? 1 : 2;
+        for(size_t v=0;v<vertexCount;v++) if(vertexAlive[v]) byAxis.push_back(v);
+        std::sort(byAxis.begin(), byAxis.end(), [&](int a,int b){
+            return position(a)[axis]!=position(b)[axis] ? position(a)[axis]<position(b)[axis] : a<b;
+        });
+        chunk.assign(vertexCount, 0);
+    }
+
+    const glm::vec3& position(int v) const { return model.vertices[v]; }
+    bool textured(int f) const { return model.materials[model.faceMaterials[f]].textured; }
+
+    glm::vec2 cornerUV(int f,int v) const {
+        for(int k=0;k<3;k++) if(faces[f][k]==v) return faceUVs[f][k];
+        return glm::vec2(0.0f);
+    }
+    int cornerSource(int f,int v) const {
+        for(int k=0;k<3;k++) if(faces[f][k]==v) return sources[f][k];
+        return -1;
+    }
+
+    void weldVertices(){
+        std::vector<int> order(model.vertices.size());
+        for(size_t v=0;v<order.size();v++) order[v] = v;
+        std::sort(order.begin(), order.end(), [&](int a,int b){
+            const glm::vec3 &p = position(a), &q = position(b);
+            if(p.x!=q.x) return p.x<q.x;
+            if(p.y!=q.y) return p.y<q.y;
+            if(p.z!=q.z) return p.z<q.z;
+            return a<b;
+        });
+        weld.resize(order.size());
+        for(size_t i=0;i<order.size();i++)
+            weld[order[i]] = i>0 && position(order[i])==position(order[i-1]) ? weld[order[i-1]] : order[i];
+    }
+
+    // Classifies every edge once, then queues it. An edge is a border when it
+    // does not join exactly two faces of one material that agree on its UVs
+    // and on the vertices at its ends. Border edges get a plane across them;
+    // vertices with two border edges become BORDER, with one or more than
+    // two LOCKED, as are vertices whose faces disagree on their vertex or
+    // whose textured faces disagree on their UV.
+    void findEdges(){
+        struct EdgeFace { int a, b, face; };
+        std::vector<EdgeFace> edges;
+        edges.reserve(liveFaces*3);
+        for(size_t f=0;f<faces.size();f++){
+            if(!faceAlive[f]) continue;
+            for(int k=0;k<3;k++){
+                int a = faces[f][k], b = faces[f][(k+1)%3];
+                edges.push_back({ std::min(a,b), std::max(a,b), int(f) });
+            }
+        }
+        std::sort(edges.begin(), edges.end(), [](const EdgeFace &x,const EdgeFace &y){
+            return x.a!=y.a ? x.a<y.a : x.b<y.b;
+        });
+        for(size_t i=0;i<edges.size();){
+            size_t j = i;
+            while(j<edges.size() && edges[j].a==edges[i].a && edges[j].b==edges[i].b) j++;
+            int a = edges[i].a, b = edges[i].b;
+            bool border = j-i!=2;
+            if(!border){
+                int f = edges[i].face, g = edges[i+1].face;
+                border = model.faceMaterials[f]!=model.faceMaterials[g] ||
+                         cornerSource(f,a)!=cornerSource(g,a) || cornerSource(f,b)!=cornerSource(g,b) ||
+                         (textured(f) && (cornerUV(f,a)!=cornerUV(g,a) || cornerUV(f,b)!=cornerUV(g,b)));
+            }
+            if(border && a!=b){
+                borderNeighbours[a].push_back(b);
+                borderNeighbours[b].push_back(a);
+                glm::vec3 e = position(b)-position(a);
+                for(size_t k=i;k<j;k++){
+                    const auto &f = faces[edges[k].face];
+                    glm::vec3 n = glm::cross(position(f[1])-position(f[0]), position(f[2])-position(f[0]));
+                    glm::vec3 across = glm::cross(e, n);
+                    if(glm::length(across)<=0.0f) continue;
+                    across = glm::normalize(across);
+                    double d = -glm::dot(across, position(a));
+                    double w = LOD_BORDER_WEIGHT*glm::dot(e,e);
+                    quadrics[a].addPlane(across.x,across.y,across.z,d,w);
+                    quadrics[b].addPlane(across.x,across.y,across.z,d,w);
+                }
+            }
+            i = j;
+        }
+        for(size_t v=0;v<kind.size();v++){
+            size_t count = borderNeighbours[v].size();
+            kind[v] = count==0 ? VERTEX_INTERIOR : count==2 ? VERTEX_BORDER : VERTEX_LOCKED;
+            bool hasUV = false;
+            glm::vec2 uv(0.0f);
+            for(int f : vertexFaces[v]){
+                if(cornerSource(f,v)!=cornerSource(vertexFaces[v][0],v)) kind[v] = VERTEX_LOCKED;
+                if(!textured(f)) continue;
+                glm::vec2 c = cornerUV(f,v);
+                if(hasUV && c!=uv) kind[v] = VERTEX_LOCKED;
+                hasUV = true; uv = c;
+            }
+        }
+    }
+
+    bool mayMove(int from,int to) const {
+        if(kind[from]==VERTEX_INTERIOR) return true;
+        if(kind[from]==VERTEX_LOCKED) return false;
+        const auto &n = borderNeighbours[from];
+        return std::find(n.begin(), n.end(), to)!=n.end();
+    }
+
+    double cost(int from,int to) const {
+        Quadric q = quadrics[from];
+        q += quadrics[to];
+        // Flat regions cost nothing to collapse; the length term makes them
+        // go shortest edge first instead of all into one growing fan
+        glm::vec3 e = position(to)-position(from);
+        double lengthSq = glm::dot(e,e);
+        return q.error(position(to)) + LOD_LENGTH_WEIGHT*lengthSq*lengthSq;
+    }
+
+    // The cheaper allowed direction of edge a-b; false if neither may move
+    bool cheaper(int a,int b,Collapse &c) const {
+        bool ab = a!=b && mayMove(a,b), ba = a!=b && mayMove(b,a);
+        double costAB = ab ? cost(a,b) : 0.0, costBA = ba ? cost(b,a) : 0.0;
+        if(ab && (!ba || costAB<=costBA)) c = { costAB, a, b };
+        else if(ba) c = { costBA, b, a };
+        return ab || ba;
+    }
+    void push(Queue &queue,int a,int b) const {
+        Collapse c;
+        if(cheaper(a,b,c)) queue.push(c);
+    }
+
+    // Collapsing from onto to must keep the surface a manifold (the two
+    // vertices share exactly the neighbours of the faces between them),
+    // must not fold any remaining face over, and needs a vertex and UV for
+    // from's corners, taken from a face across the edge
+    bool valid(int from,int to,Scratch &scratch) const {
+        std::vector<int> &shared = scratch.shared;
+        std::vector<int> &fromNeighbours = scratch.fromNeighbours, &toNeighbours = scratch.toNeighbours;
+        shared.clear();
+        fromNeighbours.clear();
+        toNeighbours.clear();
+        for(int f : vertexFaces[from]){
+            if(!faceAlive[f]) continue;
+            bool hasTo = false;
+            for(int v : faces[f]){
+                if(v==to) hasTo = true;
+                if(v!=from) fromNeighbours.push_back(v);
+            }
+            if(hasTo) shared.push_back(f);
+        }
+        if(shared.empty()) return false;
+        for(int f : vertexFaces[to])
+            if(faceAlive[f])
+                for(int v : faces[f]) if(v!=to) toNeighbours.push_back(v);
+        std::sort(fromNeighbours.begin(), fromNeighbours.end());
+        fromNeighbours.erase(std::unique(fromNeighbours.begin(), fromNeighbours.end()), fromNeighbours.end());
+        std::sort(toNeighbours.begin(), toNeighbours.end());
+        toNeighbours.erase(std::unique(toNeighbours.begin(), toNeighbours.end()), toNeighbours.end());
+        size_t common = 0;
+        for(size_t i=0,j=0;i<fromNeighbours.size() && j<toNeighbours.size();){
+            if(fromNeighbours[i]<toNeighbours[j]) i++;
+            else if(fromNeighbours[i]>toNeighbours[j]) j++;
+            else { common++; i++; j++; }
+        }
+        if(common!=shared.size()) return false;
+
+        for(int f : vertexFaces[from]){
+            if(!faceAlive[f] || std::find(shared.begin(), shared.end(), f)!=shared.end()) continue;
+            const auto &t = faces[f];
+            glm::vec3 p[3], q[3];
+            for(int k=0;k<3;k++){ p[k] = position(t[k]); q[k] = position(t[k]==from ? to : t[k]); }
+            glm::vec3 before = glm::cross(p[1]-p[0], p[2]-p[0]);
+            glm::vec3 after = glm::cross(q[1]-q[0], q[2]-q[0]);
+            if(glm::length(after)<=0.0f) return false;
+            float lengths = glm::length(before)*glm::length(after);
+            if(glm::dot(before,after) < LOD_MIN_FLIP_DOT*lengths) return false;
+            if(faceAcross(f,to,shared)<0) return false;
+        }
+        return true;
+    }
+
+    // A face across the collapsing edge with f's material, whose vertex and
+    // UV at to f takes over; -1 if there is none, or if such faces disagree
+    int faceAcross(int f,int to,const std::vector<int> &shared) const {
+        int across = -1;
+        for(int g : shared){
+            if(model.faceMaterials[g]!=model.faceMaterials[f]) continue;
+            if(across<0) across = g;
+            else if(cornerSource(g,to)!=cornerSource(across,to) ||
+                    (textured(f) && cornerUV(g,to)!=cornerUV(across,to))) return -1;
+        }
+        return across;
+    }
+
+    // Returns the number of faces removed; pushes the edges around to
+    size_t collapse(Queue &queue,int from,int to,Scratch &scratch){
+        const std::vector<int> &shared = scratch.shared;
+        size_t removed = 0;
+        // from ends up as far from the surface as from the nearest face
+        // plane around it after the move
+        float distance = glm::length(position(from)-position(to));
+        for(int f : vertexFaces[from]){
+            if(!faceAlive[f] || std::find(shared.begin(), shared.end(), f)!=shared.end()) continue;
+            glm::vec3 q[3];
+            for(int k=0;k<3;k++) q[k] = position(faces[f][k]==from ? to : faces[f][k]);
+            glm::vec3 n = glm::normalize(glm::cross(q[1]-q[0], q[2]-q[0]));
+            distance = std::min(distance, std::abs(glm::dot(n, position(from)-q[0])));
+        }
+        deviation[to] = std::max(deviation[to], deviation[from]+distance);
+
+        for(int f : vertexFaces[from]){
+            if(!faceAlive[f]) continue;
+            if(std::find(shared.begin(), shared.end(), f)!=shared.end()){
+                faceAlive[f] = 0;
+                removed++;
+                continue;
+            }
+            int across = faceAcross(f,to,shared);
+            for(int k=0;k<3;k++)
+                if(faces[f][k]==from){
+                    faces[f][k] = to;
+                    sources[f][k] = cornerSource(across,to);
+                    if(textured(f)) faceUVs[f][k] = cornerUV(across,to);
+                }
+            vertexFaces[to].push_back(f);
+        }
+        quadrics[to] += quadrics[from];
+        vertexAlive[from] = 0;
+        vertexFaces[from].clear();
+
+        for(int w : borderNeighbours[from]){
+            if(w==to) continue;
+            for(int &n : borderNeighbours[w]) if(n==from) n = to;
+            borderNeighbours[to].push_back(w);
+        }
+        auto &toBorder = borderNeighbours[to];
+        toBorder.erase(std::remove(toBorder.begin(), toBorder.end(), from), toBorder.end());
+        borderNeighbours[from].clear();
+
+        auto &around = vertexFaces[to];
+        around.erase(std::remove_if(around.begin(), around.end(), [&](int f){ return !faceAlive[f]; }), around.end());
+        std::vector<int> &neighbours = scratch.neighbours;
+        neighbours.clear();
+        for(int f : around)
+            for(int v : faces[f])
+                if(v!=to) neighbours.push_back(v);
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for(int v : neighbours) push(queue,to,v);
+        return removed;
+    }
+
+    // Whether every live face around v lies wholly in slab c; a collapse
+    // touches only the faces and vertices around its two ends, so slabs
+    // that keep to such edges can run side by side. -1 takes any edge.
+    bool inChunk(int v,int c) const {
+        if(c<0) return true;
+        for(int f : vertexFaces[v])
+            if(faceAlive[f])
+                for(int w : faces[f]) if(chunk[w]!=c) return false;
+        return true;
+    }
+
+    // The cheaper direction of every live edge, found from its lower end
+    // in blocks of vertices in parallel, in vertex order
+    std::vector<Collapse> liveEdges() const {
+        const int blocks = 4*(LOD_CHUNKS+1);
+        size_t vertexCount = vertexAlive.size();
+        std::vector<std::vector<Collapse>> parts(blocks);
+        parallelFor(blocks, [&](int b){
+            std::vector<int> ring;
+            Collapse c;
+            for(size_t a=vertexCount*b/blocks;a<vertexCount*(b+1)/blocks;a++){
+                if(!vertexAlive[a]) continue;
+                ring.clear();
+                for(int f : vertexFaces[a])
+                    if(faceAlive[f])
+                        for(int v : faces[f]) if(v>int(a)) ring.push_back(v);
+                std::sort(ring.begin(), ring.end());
+                ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+                for(int v : ring) if(cheaper(a,v,c)) parts[b].push_back(c);
+            }
+        });
+        std::vector<Collapse> collapses;
+        for(const auto &part : parts) collapses.insert(collapses.end(), part.begin(), part.end());
+        return collapses;
+    }
+
+    // Collapses the cheapest edges of queue, up to limit in cost, that stay
+    // inside slab c until remove faces are gone; returns the faces removed
+    size_t collapseCheapest(Queue &queue,size_t remove,double limit,int c,Scratch &scratch){
+        size_t removed = 0;
+        while(removed<remove && !queue.empty() && queue.top().cost<=limit){
+            Collapse e = queue.top();
+            queue.pop();
+            if(!vertexAlive[e.from] || !vertexAlive[e.to] || cost(e.from,e.to)!=e.cost) continue;
+            if(!inChunk(e.from,c) || !inChunk(e.to,c)) continue;
+            if(mayMove(e.from,e.to) && valid(e.from,e.to,scratch)) removed += collapse(queue,e.from,e.to,scratch);
+            else if(mayMove(e.to,e.from) && valid(e.to,e.from,scratch)) removed += collapse(queue,e.to,e.from,scratch);
+        }
+        return removed;
+    }
+
+    // Collapses the cheapest edges until at most target faces are left;
+    // false when no valid collapse remains. Most of the work runs in
+    // rounds in which the slabs, with boundaries offset by half a slab
+    // every other round, collapse in parallel the edges inside them that
+    // cost no more than the excess-th cheapest edge overall, each up to its
+    // share of the faces to remove by how many of those edges it holds.
+    // Once a round falls short of half the excess, a serial pass over all
+    // edges removes the rest.
+    bool reduce(size_t target,int level){
+        for(int round=0;liveFaces>target;round++){
+            std::vector<Collapse> edges = liveEdges();
+            if(edges.empty()) return false;
+            size_t excess = liveFaces-target;
+            if(round==LOD_MAX_ROUNDS){
+                Queue all(std::greater<Collapse>(), std::move(edges));
+                Scratch scratch;
+                liveFaces -= collapseCheapest(all, excess, HUGE_VAL, -1, scratch);
+                break;
+            }
+
+            size_t aliveVertices = 0, rank = 0;
+            for(int v : byAxis) aliveVertices += vertexAlive[v];
+            for(int v : byAxis)
+                if(vertexAlive[v]) chunk[v] = int((2*(rank++)*LOD_CHUNKS/aliveVertices + ((level+round)&1))/2);
+
+            std::vector<double> costs(edges.size());
+            for(size_t i=0;i<edges.size();i++) costs[i] = edges[i].cost;
+            auto nth = costs.begin() + std::min(excess, costs.size()-1);
+            std::nth_element(costs.begin(), nth, costs.end());
+            double limit = *nth;
+
+            std::vector<std::vector<Collapse>> slabEdges(LOD_CHUNKS+1);
+            std::vector<size_t> cheap(LOD_CHUNKS+1, 0), removed(LOD_CHUNKS+1, 0);
+            size_t cheapTotal = 0;
+            for(const Collapse &e : edges){
+                int c = chunk[e.from];
+                if(chunk[e.to]!=c) continue;
+                slabEdges[c].push_back(e);
+                if(e.cost<=limit){ cheap[c]++; cheapTotal++; }
+            }
+            edges = std::vector<Collapse>();
+            parallelFor(LOD_CHUNKS+1, [&](int c){
+                Queue queue(std::greater<Collapse>(), std::move(slabEdges[c]));
+                Scratch scratch;
+                if(cheapTotal) removed[c] = collapseCheapest(queue, excess*cheap[c]/cheapTotal, limit, c, scratch);
+            });
+            size_t total = 0;
+            for(size_t r : removed) total += r;
+            liveFaces -= total;
+            if(total<excess/2) round = LOD_MAX_ROUNDS-1;
+        }
+        return liveFaces<=target;
+    }
+
+    Model snapshot() const {
+        std::vector<LODFaceRecord> records;
+        records.reserve(liveFaces);
+        for(size_t f=0;f<faces.size();f++)
+            if(faceAlive[f])
+                records.push_back({ int32_t(f), { sources[f][0], sources[f][1], sources[f][2] },
+                                    { faceUVs[f][0], faceUVs[f][1], faceUVs[f][2] } });
+        float error = 0.0f;
+        for(size_t v=0;v<deviation.size();v++)
+            if(vertexAlive[v]) error = std::max(error, deviation[v]);
+        return makeLOD(model, records, error);
+    }
+};
+
+// Fills model.lods with successively halved copies of model, stopping at
+// LOD_MIN_FACES or when a halving would save less than a quarter
+inline void buildLODs(Model &model){
+    model.lods.clear();
+    if(model.faces.size()<2*LOD_MIN_FACES || model.vertexNormals.size()!=model.vertices.size()) return;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    MeshSimplifier simplifier(model);
+    size_t previous = model.faces.size();
+    for(int level=0;model.lods.size()<LOD_MAX_LEVELS && previous/2>=LOD_MIN_FACES;level++){
+        bool reached = simplifier.reduce(previous/2,level);
+        if(simplifier.liveFaces>previous*3/4) break;
+        model.lods.push_back(simplifier.snapshot());
+        previous = simplifier.liveFaces;
+        if(!reached) break;
+    }
+
+    double ms = 1000.0*double(SDL_GetPerformanceCounter()-start)/SDL_GetPerformanceFrequency();
+    std::clog << "Built " << model.lods.size() << " LODs (" << model.faces.size();
+    for(const Model &lod : model.lods) std::clog << " / " << lod.faces.size();
+    std::clog << " faces) in " << ms << " ms\n";
+}
+
+// ---------- MESH CACHE ----------
+// Binary snapshot of a parsed OBJ, written next to it as <file>.meshcache and
+// memory-mapped on later runs instead of parsing. It is only used while the
+// OBJ's size, mtime and sampled content hash still match, and the MTL's size
+// and mtime too: faceUVs and the LODs depend on which materials are textured.
+// Materials are read from the (small) MTL each time, so the cache keeps only
+// their names. The LOD chain follows, as face records against the full model;
+// a cache written with LODs disabled has none and lacks MESH_CACHE_LODS, so
+// a later run with LODs builds them and rewrites it.
+#define MESH_CACHE_VERSION 6
+#define MESH_CACHE_LODS 1        // header flag: the LOD chain was built
+
+inline bool useMeshCache = true;
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t sourceHash;
+    uint64_t mtlSize;
+    int64_t mtlMtime;
+    uint64_t vertexCount, faceCount, texcoordCount, normalCount;
+    uint64_t vertexNormalCount, floorUVCount, materialCount, nameBytes;
+    uint64_t lodCount, lodFaceCount;
+    glm::vec3 boundsMin, boundsMax;
+};
+
+struct LODCacheEntry {
+    uint64_t faceCount;
+    float error;
+    uint32_t reserved;
+};
+
+struct FloorUVRecord {
+    int32_t face;
+    glm::vec2 uv[3];
+};
+
+// FNV-1a over up to 16 evenly spaced 64 KB blocks: cheap even on multi-GB
+// files, and catches edits that keep both size and mtime.
+inline uint64_t sampledFileHash(const MappedFile &file){
+    const size_t block = 64*1024;
+    const int samples = 16;
+    uint64_t h = 1469598103934665603ull;
+    for(int i=0;i<samples;i++){
+        size_t begin = file.size>block ? (file.size-block)*i/(samples-1) : 0;
+        size_t end = std::min(file.size, begin+block);
+        for(size_t k=begin;k<end;k++){ h ^= (uint8_t)file.data[k]; h *= 1099511628211ull; }
+        if(file.size<=block) break;
+    }
+    return h;
+}
+
+inline bool meshCacheStamp(const std::string &objPath,MeshCacheHeader &h){
+    struct stat st;
+    if(stat(objPath.c_str(),&st)!=0) return false;
+    MappedFile source;
+    if(!source.open(objPath)) return false;
+    h.sourceSize = st.st_size;
+    h.sourceMtime = st.st_mtime;
+    h.sourceHash = sampledFileHash(source);
+    return true;
+}
+
+// A model without an MTL, or whose MTL is missing, stamps as 0/0
+inline void mtlCacheStamp(const std::string &mtlPath,MeshCacheHeader &h){
+    struct stat st;
+    bool found = !mtlPath.empty() && stat(mtlPath.c_str(),&st)==0;
+    h.mtlSize = found ? st.st_size : 0;
+    h.mtlMtime = found ? st.st_mtime : 0;
+}
+
+inline void writeMeshCache(const std::string &objPath,const Model &model){
+    MeshCacheHeader h{};
+    std::memcpy(h.magic, "MESHCCH", 8);
+    h.version = MESH_CACHE_VERSION;
+    h.flags = lodEnabled ? MESH_CACHE_LODS : 0;
+    if(!meshCacheStamp(objPath,h)) return;
+    mtlCacheStamp(model.mtllib,h);
+
+    std::string nameBlob = model.mtllib + '\0';
+    for(const auto &m : model.materials) nameBlob += m.name + '\0';
+
+    std::vector<FloorUVRecord> floorUVs;
+    for(size_t i=0;i<model.faces.size();i++)
+        if(model.materials[model.faceMaterials[i]].textured)
+            floorUVs.push_back({ int32_t(i), { model.faceUVs[i][0], model.faceUVs[i][1], model.faceUVs[i][2] } });
+
+    h.vertexCount = model.vertices.size();
+    h.faceCount = model.faces.size();
+    h.texcoordCount = model.texcoords.size();
+    h.normalCount = model.normals.size();
+    h.vertexNormalCount = model.vertexNormals.size();
+    h.floorUVCount = floorUVs.size();
+    h.materialCount = model.materials.size();
+    h.nameBytes = nameBlob.size();
+
+    std::vector<LODCacheEntry> lodTable;
+    std::vector<LODFaceRecord> lodFaces;
+    for(const Model &lod : model.lods){
+        lodTable.push_back({ lod.faces.size(), lod.lodError, 0 });
+        for(size_t i=0;i<lod.faces.size();i++){
+            LODFaceRecord r{ lod.faceSources[i], {}, {} };
+            for(int k=0;k<3;k++){
+                r.corners[k] = lod.vertexSources[lod.faces[i][k]-1];
+                r.uv[k] = lod.faceUVs[i][k];
+            }
+            lodFaces.push_back(r);
+        }
+    }
+    h.lodCount = lodTable.size();
+    h.lodFaceCount = lodFaces.size();
+    h.boundsMin = model.boundsMin;
+    h.boundsMax = model.boundsMax;
+
+    // Write to a temporary name of this process's own and rename it over
+    // the cache, so readers never see half a cache and processes writing
+    // the same cache at once (shard workers) do not write into each other
+#if defined(_WIN32)
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    std::string cachePath = objPath + ".meshcache";
+    std::string tmpPath = cachePath + "." + std::to_string(pid) + ".tmp";
+    FILE* f = std::fopen(tmpPath.c_str(), "wb");
+    if(!f){ std::cerr << "Failed to write mesh cache: " << tmpPath << std::endl; return; }
+    bool ok = std::fwrite(&h, sizeof(h), 1, f)==1;
+    auto put = [&](const void* data,size_t bytes){ if(bytes) ok = ok && std::fwrite(data, 1, bytes, f)==bytes; };
+    put(model.vertices.data(), model.vertices.size()*sizeof(glm::vec3));
+    put(model.faces.data(), model.faces.size()*sizeof(std::array<int,3>));
+    put(model.faceTexcoords.data(), model.faceTexcoords.size()*sizeof(std::array<int,3>));
+    put(model.faceNormals.data(), model.faceNormals.size()*sizeof(std::array<int,3>));
+    put(model.faceMaterials.data(), model.faceMaterials.size()*sizeof(uint32_t));
+    put(model.texcoords.data(), model.texcoords.size()*sizeof(glm::vec2));
+    put(model.normals.data(), model.normals.size()*sizeof(glm::vec3));
+    put(model.vertexNormals.data(), model.vertexNormals.size()*sizeof(glm::vec3));
+    put(floorUVs.data(), floorUVs.size()*sizeof(FloorUVRecord));
+    put(nameBlob.data(), nameBlob.size());
+    put(lodTable.data(), lodTable.size()*sizeof(LODCacheEntry));
+    put(lodFaces.data(), lodFaces.size()*sizeof(LODFaceRecord));
+    ok = (std::fclose(f)==0) && ok;
+    if(!ok || !publishFrameFile(tmpPath, cachePath)){
+        std::cerr << "Failed to write mesh cache: " << cachePath << std::endl;
+        std::remove(tmpPath.c_str());
+    }
+}
+
+inline bool readMeshCache(const std::string &objPath,Model &model){
+    Uint64 start = SDL_GetPerformanceCounter();
+    std::string cachePath = objPath + ".meshcache";
+    MappedFile cache;
+    if(!cache.open(cachePath) || cache.size<sizeof(MeshCacheHeader)) return false;
+
+    MeshCacheHeader h;
+    std::memcpy(&h, cache.data, sizeof(h));
+    MeshCacheHeader current{};
+    if(std::memcmp(h.magic, "MESHCCH", 8)!=0 || h.version!=MESH_CACHE_VERSION) return false;
+    if(!meshCacheStamp(objPath,current) || current.sourceSize!=h.sourceSize ||
+       current.sourceMtime!=h.sourceMtime || current.sourceHash!=h.sourceHash) return false;
+
+    size_t expected = sizeof(h) + h.vertexCount*sizeof(glm::vec3) + h.faceCount*(3*sizeof(std::array<int,3>)+sizeof(uint32_t))
+                    + h.texcoordCount*sizeof(glm::vec2) + h.normalCount*sizeof(glm::vec3)
+                    + h.vertexNormalCount*sizeof(glm::vec3) + h.floorUVCount*sizeof(FloorUVRecord) + h.nameBytes
+                    + h.lodCount*sizeof(LODCacheEntry) + h.lodFaceCount*sizeof(LODFaceRecord);
+    if(cache.size!=expected){ std::cerr << "Ignoring damaged mesh cache: " << cachePath << std::endl; return false; }
+
+    const char* p = cache.data + sizeof(h);
+    auto take = [&](auto &vec,size_t count){
+        vec.resize(count);
+        if(count==0) return;
+        std::memcpy(vec.data(), p, count*sizeof(vec[0]));
+        p += count*sizeof(vec[0]);
+    };
+    std::vector<glm::vec3> vertexNormals;
+    std::vector<FloorUVRecord> floorUVs;
+    take(model.vertices, h.vertexCount);
+    take(model.faces, h.faceCount);
+    take(model.faceTexcoords, h.faceCount);
+    take(model.faceNormals, h.faceCount);
+    take(model.faceMaterials, h.faceCount);
+    take(model.texcoords, h.texcoordCount);
+    take(model.normals, h.normalCount);
+    take(vertexNormals, h.vertexNormalCount);
+    take(floorUVs, h.floorUVCount);
+
+    // NUL-terminated names, each of which must end inside the blob
+    const char* namesEnd = p + h.nameBytes;
+    auto nextName = [&](std::string &name){
+        const char* nul = (const char*)std::memchr(p, '\0', namesEnd-p);
+        if(!nul) return false;
+        name.assign(p, nul);
+        p = nul+1;
+        return true;
+    };
+    std::string mtllib;
+    std::vector<std::string> names;
+    if(!nextName(mtllib)) return false;
+    while(p<namesEnd){
+        std::string name;
+        if(!nextName(name)) return false;
+        names.push_back(name);
+    }
+    if(names.size()!=h.materialCount) return false;
+    mtlCacheStamp(mtllib,current);
+    if(current.mtlSize!=h.mtlSize || current.mtlMtime!=h.mtlMtime) return false;
+
+    std::vector<LODCacheEntry> lodTable;
+    std::vector<LODFaceRecord> lodFaces;
+    take(lodTable, h.lodCount);
+    take(lodFaces, h.lodFaceCount);
+    uint64_t lodFaceTotal = 0;
+    for(const auto &e : lodTable) lodFaceTotal += e.faceCount;
+    if(lodFaceTotal!=h.lodFaceCount) return false;
+    for(const auto &r : lodFaces){
+        if(r.source<0 || uint64_t(r.source)>=h.faceCount) return false;
+        for(int c : r.corners) if(c<0 || uint64_t(c)>=h.vertexCount) return false;
+    }
+
+    for(uint32_t id : model.faceMaterials) if(id>=names.size()) return false;
+    for(const auto &f : model.faces)
+        for(int v : f) if(v<1 || uint64_t(v)>h.vertexCount) return false;
+    model.faceUVs.assign(h.faceCount, {});
+    for(const auto &r : floorUVs){
+        if(r.face<0 || size_t(r.face)>=h.faceCount) return false;
+        model.faceUVs[r.face] = { r.uv[0], r.uv[1], r.uv[2] };
+    }
+    model.boundsMin = h.boundsMin;
+    model.boundsMax = h.boundsMax;
+
+    // Cached IDs are first-use order, which interning the names in order reproduces
+    model.mtllib = mtllib;
+    std::map<std::string,Material> library;
+    if(!mtllib.empty()) library = loadMTL(mtllib);
+    for(const auto &n : names) internMaterial(model, library, n);
+    if(vertexNormals.size()!=model.vertices.size()) return false;
+    model.vertexNormals = std::move(vertexNormals);
+    if(lodEnabled && !(h.flags & MESH_CACHE_LODS)){
+        buildLODs(model);
+        writeMeshCache(objPath,model);
+    }
+    else if(lodEnabled){
+        auto records = lodFaces.begin();
+        for(const auto &e : lodTable){
+            model.lods.push_back(makeLOD(model, std::vector<LODFaceRecord>(records, records+e.faceCount), e.error));
+            records += e.faceCount;
+        }
+    }
+
+    double ms = 1000.0*double(SDL_GetPerformanceCounter()-start)/SDL_GetPerformanceFrequency();
+    std::clog << "Loaded " << cachePath << ": " << model.vertices.size() << " vertices, "
+              << model.faces.size() << " faces, " << model.lods.size() << " LODs in " << ms << " ms\n";
+    return true;
+}
+
+// Loads filename through its mesh cache, (re)building the cache, and the
+// LODs when enabled, on a miss
+inline Model loadModel(const std::string &filename){
+    Model model;
+    if(useMeshCache && readMeshCache(filename,model)) return model;
+    model = loadOBJ(filename);
+    if(lodEnabled) buildLODs(model);
+    if(useMeshCache) writeMeshCache(filename,model);
+    return model;
+}
+
+// The camera for one frame, built once by processVertices
+struct FrameView {
+    glm::mat4 rot;      // model -> view space (orbit rotation)
+    bool perspective;
+    float focal;        // perspective: pixels per unit at distance 1
+    float distance;     // perspective: camera distance from the origin
+    float scale;        // orthographic: pixels per unit
+    glm::vec2 halfSize; // half the framebuffer size
+    glm::vec2 pan;      // window offset of the origin
+    float tilt;         // extra vertical offset
+};
+
+inline FrameView makeFrameView(const Camera &camera,const Framebuffer &fb){
+    FrameView view;
+    view.rot = glm::rotate(glm::mat4(1.0f), camera.orbitX, glm::vec3(0,1,0));
+    view.rot = glm::rotate(view.rot, camera.orbitY, glm::vec3(1,0,0));
+    view.perspective = projection==PROJECTION_PERSPECTIVE;
+    view.focal = (fb.height/2.0f)/std::tan(glm::radians(fieldOfView)/2.0f);
+    view.distance = view.focal/camera.scale;
+    view.scale = camera.scale;
+    view.halfSize = glm::vec2(fb.width/2.0f, fb.height/2.0f);
+    view.pan = camera.panOffset;
+    view.tilt = camera.tiltOffset;
+    return view;
+}
+
+inline glm::vec3 toView(const FrameView &view,const glm::vec3 &v){
+    return glm::vec3(view.rot*glm::vec4(v,1.0f));
+}
+
+// Distance of view-space point r in front of the camera, 1 when orthographic
+inline float viewW(const FrameView &view,const glm::vec3 &r){
+    return view.perspective ? view.distance-r.z : 1.0f;
+}
+
+// Window position of view-space point r, which must have w>0. depth grows
+// toward the camera and is affine in screen space (view z, or 1/w in
+// perspective), which is what the interpolated depth test needs.
+inline glm::vec2 projectView(const FrameView &view,const glm::vec3 &r,float w,float &depth){
+    if(!view.perspective){
+        depth = r.z;
+        return glm::vec2(r.x*view.scale + view.halfSize.x + view.pan.x,
+                         -r.y*view.scale + view.halfSize.y + view.pan.y + view.tilt);
+    }
+    depth = 1.0f/w;
+    float k = view.focal*depth;
+    return glm::vec2(r.x*k + view.halfSize.x + view.pan.x,
+                     -r.y*k + view.halfSize.y + view.pan.y + view.tilt);
+}
+
+inline glm::vec3 faceNormal(const glm::vec3 &v0,const glm::vec3 &v1,const glm::vec3 &v2){
+    return glm::normalize(glm::cross(v1-v0,v2-v0));
+}
+
+inline glm::vec3 barycentric(const glm::vec2 &p,const glm::vec2 &a,const glm::vec2 &b,const glm::vec2 &c){
+    float det = (b.y-c.y)*(a.x-c.x) + (c.x-b.x)*(a.y-c.y);
+    float w1 = ((b.y-c.y)*(p.x-c.x) + (c.x-b.x)*(p.y-c.y))/det;
+    float w2 = ((c.y-a.y)*(p.x-c.x) + (a.x-c.x)*(p.y-c.y))/det;
+    float w3 = 1.0f-w1-w2;
+    return glm::vec3(w1,w2,w3);
+}
+
+// ============================================================
+// ===================== SHADOW BVH ============================
+// ============================================================
+
+// Flattened BVH over the model for shadow rays. Nodes are 32 bytes (two per
+// cache line) and stored depth-first, so an interior node's children sit next
+// to each other at leftFirst and leftFirst+1. Leaf triangles are copied into
+// leaf order as (v0, edge1, edge2), ready for Moller-Trumbore.
+struct BVHNode {
+    glm::vec3 boundsMin;
+    int leftFirst;       // interior: left child index; leaf: first triangle
+    glm::vec3 boundsMax;
+    int count;           // triangles in a leaf, 0 for interior nodes
+};
+
+struct BVHTriangle {
+    glm::vec3 v0, e1, e2;
+};
+
+struct BVH {
+    std::vector<BVHNode> nodes;
+    std::vector<BVHTriangle> triangles;
+};
+
+inline BVH shadowBVH;
+
+#define BVH_BINS 12
+#define BVH_MAX_DEPTH 60
+
+struct BVHBuilder {
+    std::vector<glm::vec3> triMin, triMax, centroid;
+    std::vector<int> order;
+    BVH &bvh;
+
+    explicit BVHBuilder(BVH &b) : bvh(b) {}
+
+    static float area(const glm::vec3 &mn,const glm::vec3 &mx){
+        glm::vec3 d = mx-mn;
+        return d.x*d.y + d.y*d.z + d.z*d.x;
+    }
+
+    void subdivide(int nodeIndex,int first,int count,int depth){
+        glm::vec3 mn(1e30f), mx(-1e30f), cmn(1e30f), cmx(-1e30f);
+        for(int i=first;i<first+count;i++){
+            int t = order[i];
+            mn = glm::min(mn,triMin[t]); mx = glm::max(mx,triMax[t]);
+            cmn = glm::min(cmn,centroid[t]); cmx = glm::max(cmx,centroid[t]);
+        }
+        bvh.nodes[nodeIndex].boundsMin = mn;
+        bvh.nodes[nodeIndex].boundsMax = mx;
+        bvh.nodes[nodeIndex].leftFirst = first;
+        bvh.nodes[nodeIndex].count = count;
+        if(count<=2 || depth>=BVH_MAX_DEPTH) return;
+
+        // Binned SAH: cost of a split relative to intersecting every triangle here
+        int bestAxis=-1, bestBin=0;
+        float bestCost = 1e30f;
+        for(int axis=0;axis<3;axis++){
+            float extent = cmx[axis]-cmn[axis];
+            if(extent<=1e-12f) continue;
+            glm::vec3 binMin[BVH_BINS], binMax[BVH_BINS];
+            int binCount[BVH_BINS] = {};
+            for(int b=0;b<BVH_BINS;b++){ binMin[b]=glm::vec3(1e30f); binMax[b]=glm::vec3(-1e30f); }
+            float k = BVH_BINS/extent;
+            for(int i=first;i<first+count;i++){
+                int t = order[i];
+                int b = std::min(BVH_BINS-1, int((centroid[t][axis]-cmn[axis])*k));
+                binCount[b]++;
+                binMin[b] = glm::min(binMin[b],triMin[t]);
+                binMax[b] = glm::max(binMax[b],triMax[t]);
+            }
+            float rightArea[BVH_BINS]; int rightCount[BVH_BINS];
+            glm::vec3 rmn(1e30f), rmx(-1e30f); int rc=0;
+            for(int b=BVH_BINS-1;b>0;b--){
+                rc += binCount[b];
+                if(binCount[b]){ rmn=glm::min(rmn,binMin[b]); rmx=glm::max(rmx,binMax[b]); }
+                rightArea[b] = rc ? area(rmn,rmx) : 0.0f;
+                rightCount[b] = rc;
+            }
+            glm::vec3 lmn(1e30f), lmx(-1e30f); int lc=0;
+            for(int b=0;b<BVH_BINS-1;b++){
+                lc += binCount[b];
+                if(binCount[b]){ lmn=glm::min(lmn,binMin[b]); lmx=glm::max(lmx,binMax[b]); }
+                if(lc==0 || rightCount[b+1]==0) continue;
+                float cost = lc*area(lmn,lmx) + rightCount[b+1]*rightArea[b+1];
+                if(cost<bestCost){ bestCost=cost; bestAxis=axis; bestBin=b; }
+            }
+        }
+        // Stop when splitting (plus one extra box test) is no cheaper than the leaf
+        float leafCost = count*area(mn,mx);
+        if(bestAxis<0 || (bestCost+area(mn,mx)>=leafCost && count<=8)) return;
+
+        float k = BVH_BINS/(cmx[bestAxis]-cmn[bestAxis]);
+        int* mid = std::partition(order.data()+first, order.data()+first+count, [&](int t){
+            return std::min(BVH_BINS-1, int((centroid[t][bestAxis]-cmn[bestAxis])*k)) <= bestBin;
+        });
+        int leftCount = mid-(order.data()+first);
+
+        int left = bvh.nodes.size();
+        bvh.nodes.emplace_back();
+        bvh.nodes.emplace_back();
+        bvh.nodes[nodeIndex].leftFirst = left;
+        bvh.nodes[nodeIndex].count = 0;
+        subdivide(left, first, leftCount, depth+1);
+        subdivide(left+1, first+leftCount, count-leftCount, depth+1);
+    }
+};
+
+// Must be rebuilt whenever the vertices move (e.g. after centerModel)
+inline void buildBVH(BVH &bvh,const Model &model){
+    Uint64 start = SDL_GetPerformanceCounter();
+    int n = model.faces.size();
+    BVHBuilder b(bvh);
+    b.triMin.resize(n); b.triMax.resize(n); b.centroid.resize(n); b.order.resize(n);
+    for(int i=0;i<n;i++){
+        const auto &f = model.faces[i];
+        glm::vec3 v0 = model.vertices[f[0]-1];
+        glm::vec3 v1 = model.vertices[f[1]-1];
+        glm::vec3 v2 = model.vertices[f[2]-1];
+        b.triMin[i] = glm::min(v0,glm::min(v1,v2));
+        b.triMax[i] = glm::max(v0,glm::max(v1,v2));
+        b.centroid[i] = (v0+v1+v2)/3.0f;
+        b.order[i] = i;
+    }
+
+    bvh.nodes.clear();
+    bvh.triangles.clear();
+    if(n==0) return;
+    bvh.nodes.reserve(2*n);
+    bvh.nodes.emplace_back();
+    b.subdivide(0,0,n,0);
+
+    bvh.triangles.resize(n);
+    for(int i=0;i<n;i++){
+        const auto &f = model.faces[b.order[i]];
+        glm::vec3 v0 = model.vertices[f[0]-1];
+        bvh.triangles[i] = { v0, model.vertices[f[1]-1]-v0, model.vertices[f[2]-1]-v0 };
+    }
+
+    double ms = 1000.0*double(SDL_GetPerformanceCounter()-start)/SDL_GetPerformanceFrequency();
+    std::clog << "Built shadow BVH: " << n << " triangles, " << bvh.nodes.size() << " nodes in " << ms << " ms\n";
+}
+
+// Distance at which the ray enters the box, or 1e30 if it misses within maxT
+inline float rayBoxEntry(const glm::vec3 &origin,const glm::vec3 &invDir,const BVHNode &node,float maxT){
+    glm::vec3 t1 = (node.boundsMin-origin)*invDir;
+    glm::vec3 t2 = (node.boundsMax-origin)*invDir;
+    float tNear = std::max({std::min(t1.x,t2.x), std::min(t1.y,t2.y), std::min(t1.z,t2.z), 0.0f});
+    float tFar  = std::min({std::max(t1.x,t2.x), std::max(t1.y,t2.y), std::max(t1.z,t2.z), maxT});
+    return tNear<=tFar ? tNear : 1e30f;
+}
+
+// Moller-Trumbore ray/triangle test, true for a hit with minT < t < maxT
+inline bool rayHitsTriangle(const glm::vec3 &origin,const glm::vec3 &dir,const BVHTriangle &tri,float minT,float maxT){
+    glm::vec3 p = glm::cross(dir,tri.e2);
+    float det = glm::dot(tri.e1,p);
+    if(std::abs(det)<1e-12f) return false;
+    float invDet = 1.0f/det;
+    glm::vec3 s = origin-tri.v0;
+    float u = glm::dot(s,p)*invDet;
+    if(u<0.0f || u>1.0f) return false;
+    glm::vec3 q = glm::cross(s,tri.e1);
+    float v = glm::dot(dir,q)*invDet;
+    if(v<0.0f || u+v>1.0f) return false;
+    float t = glm::dot(tri.e2,q)*invDet;
+    return t>minT && t<maxT;
+}
+
+// ---------- HARD SHADOW HELPER ----------
+// Any-hit traversal: returns as soon as one triangle blocks the light.
+inline bool inShadow(const glm::vec3 &point, const BVH &bvh){
+    if(bvh.nodes.empty()) return false;
+    profileCounts[COUNTER_SHADOW_RAYS]++;
+    glm::vec3 dir = glm::normalize(lightPos - point);
+    float lightDist = glm::length(lightPos - point);
+    glm::vec3 invDir(1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z);
+
+    if(rayBoxEntry(point,invDir,bvh.nodes[0],lightDist)>=1e30f) return false;
+
+    int stack[BVH_MAX_DEPTH+4];
+    int sp = 0, node = 0;
+    while(true){
+        const BVHNode &n = bvh.nodes[node];
+        if(n.count>0){
+            for(int i=n.leftFirst;i<n.leftFirst+n.count;i++)
+                if(rayHitsTriangle(point,dir,bvh.triangles[i],0.001f,lightDist)) return true; // blocked
+        }
+        else{
+            int nearChild = n.leftFirst, farChild = n.leftFirst+1;
+            float dNear = rayBoxEntry(point,invDir,bvh.nodes[nearChild],lightDist);
+            float dFar  = rayBoxEntry(point,invDir,bvh.nodes[farChild],lightDist);
+            if(dFar<dNear){ std::swap(nearChild,farChild); std::swap(dNear,dFar); }
+            if(dNear<1e30f){
+                if(dFar<1e30f) stack[sp++] = farChild;
+                node = nearChild;
+                continue;
+            }
+        }
+        if(sp==0) return false;
+        node = stack[--sp];
+    }
+}
+
+// ---------- SHADOW VISIBILITY CACHE ----------
+// A face's shadow ray runs from its centroid to lightPos, so the answer only
+// changes when the light or the geometry moves, never with the camera. Each
+// face is traced once and the result kept until then: a moved light
+// retraces every face, and so does invalidateShadowCache (centerModel
+// calls it after moving the whole model). An edit to part of the geometry
+// only retraces the faces it can affect, see invalidateShadowRegion.
+// Steady-state frames trace no rays at all.
+struct ShadowCache {
+    std::vector<uint8_t> shadowed;   // per face: centroid blocked from lightPos
+    std::vector<int> dirty;          // faces to retrace on the next update, may repeat
+    bool valid = false;              // shadowed is current for the model's vertices and light
+    glm::vec3 light{0.0f};           // lightPos the entries were traced from
+};
+
+inline ShadowCache shadowCache;
+
+inline glm::vec3 faceCentroid(const Model &model,int faceIndex){
+    const auto &f = model.faces[faceIndex];
+    return (model.vertices[f[0]-1]+model.vertices[f[1]-1]+model.vertices[f[2]-1])/3.0f;
+}
+
+// Brings the cache up to date for model and the current lightPos. bvh must
+// already match the model's vertices.
+inline void updateShadowCache(const Model &model,const BVH &bvh){
+    int faceCount = model.faces.size();
+    bool full = !shadowCache.valid || shadowCache.shadowed.size()!=size_t(faceCount) || shadowCache.light!=lightPos;
+    if(!full && shadowCache.dirty.empty()) return;
+
+    ProfileScope scope(STAGE_SHADOW_CACHE);
+    std::vector<int> &faces = shadowCache.dirty;
+    if(full){
+        shadowCache.shadowed.resize(faceCount);
+        faces.resize(faceCount);
+        for(int i=0;i<faceCount;i++) faces[i] = i;
+    }
+    else{
+        // Each face once, so no two workers write the same entry
+        std::sort(faces.begin(), faces.end());
+        faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+    }
+    const int chunk = 256;
+    int count = faces.size();
+    parallelFor((count+chunk-1)/chunk, [&](int c){
+        int end = std::min(count,(c+1)*chunk);
+        for(int k=c*chunk;k<end;k++)
+            shadowCache.shadowed[faces[k]] = inShadow(faceCentroid(model,faces[k]), bvh);
+    });
+    faces.clear();
+    shadowCache.valid = true;
+    shadowCache.light = lightPos;
+}
+
+// Drops every entry, e.g. after the whole model moved
+inline void invalidateShadowCache(){
+    shadowCache.valid = false;
+    shadowCache.dirty.clear();
+}
+
+// Retraces just these faces on the next update. Nothing to do while the
+// whole cache is due anyway.
+inline void invalidateShadowFaces(const std::vector<int> &faces){
+    if(!shadowCache.valid) return;
+    shadowCache.dirty.insert(shadowCache.dirty.end(), faces.begin(), faces.end());
+}
+
+// ============================================================
+// ===================== SHADOW MAP ============================
+// ============================================================
+
+// SHADOW_RAY casts one BVH ray per face centroid during setup. SHADOW_MAP
+// rasterizes the model's depth from lightPos and looks the shadow up per
+// pixel, so shadows cost one extra depth pass and become per-pixel instead
+// of per-face. Like the ray results, the map does not depend on the camera:
+// it is only rendered again when the light or the geometry moved.
+enum ShadowMode { SHADOW_RAY, SHADOW_MAP };
+inline ShadowMode shadowMode = SHADOW_RAY;
+
+#define SHADOW_MAP_SIZE 1024
+
+struct ShadowMap {
+    glm::mat4 view;                  // world -> light view, looking at the model centre
+    float focal = 1.0f;              // texels per unit at distance 1
+    std::vector<float> depth;        // distance along the light axis of the nearest surface
+    std::vector<glm::vec3> lightVerts; // per vertex: texel x, texel y, distance
+    bool valid = false;              // depth is current for the model's vertices and light
+    glm::vec3 light{0.0f};           // lightPos the map was rendered from
+};
+
+inline ShadowMap shadowMap;
+
+// renderShadowMap comes after the coverage kernels it rasterizes with, see
+// SHADOW MAP PASS below.
+
+// True when p is the closest surface to the light along its texel. slope is
+// tan of the angle between the surface and the light direction: a texel
+// covers more depth on surfaces the light grazes, so they need more bias.
+// offset is extra slack for LOD faces, which lie up to that far from the
+// full model the map was rendered from.
+inline bool litByShadowMap(const glm::vec3 &p,float slope,float offset){
+    glm::vec4 lv = shadowMap.view*glm::vec4(p,1.0f);
+    float w = -lv.z;
+    if(w<=1e-4f) return true;
+    int x = int(SHADOW_MAP_SIZE/2.0f + shadowMap.focal*lv.x/w);
+    int y = int(SHADOW_MAP_SIZE/2.0f - shadowMap.focal*lv.y/w);
+    if(x<0 || y<0 || x>=SHADOW_MAP_SIZE || y>=SHADOW_MAP_SIZE) return true;
+    float bias = 1.5f*(1.0f+slope)*w/shadowMap.focal + 1e-3f + (1.0f+slope)*offset;
+    return w <= shadowMap.depth[y*SHADOW_MAP_SIZE+x] + bias;
+}
+
+// For an edit that moved part of the model: regionMin/regionMax bound the
+// moved triangles both before and after the edit. Only a face inside that
+// box, or whose ray to the light crosses it, can change its answer, so only
+// those are retraced. The shadow BVH and the shadow map are stale as a
+// whole; draw() rebuilds them.
+inline void invalidateShadowRegion(const Model &model,const glm::vec3 &regionMin,const glm::vec3 &regionMax){
+    shadowBVH = BVH();
+    shadowMap.valid = false;
+    if(!shadowCache.valid || shadowCache.shadowed.size()!=model.faces.size()) return; // retraced in full anyway
+    BVHNode region{regionMin, 0, regionMax, 0};
+    std::vector<int> faces;
+    for(size_t i=0;i<model.faces.size();i++){
+        glm::vec3 point = faceCentroid(model,i);
+        glm::vec3 dir = glm::normalize(lightPos - point);
+        glm::vec3 invDir(1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z);
+        if(rayBoxEntry(point,invDir,region,glm::length(lightPos - point))<1e30f) faces.push_back(i);
+    }
+    invalidateShadowFaces(faces);
+}
+
+// ============================================================
+// ================== EDGE FUNCTION RASTER =====================
+// ============================================================
+
+// Coverage is decided 8x8 pixels at a time from three edge functions instead
+// of a barycentric() call per pixel. Each edge is evaluated relative to its
+// lexicographically smaller endpoint. The two triangles sharing an edge then
+// get exactly negated values, and the top-left rule gives a pixel centre
+// lying exactly on that edge to only one of them. The rows of a block are
+// evaluated by a scalar, SSE or AVX2 kernel picked from the CPU at startup.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RASTER_X86 1
+#include <immintrin.h>
+#endif
+
+struct EdgeFunctions {
+    float ox[3], oy[3];  // origin of edge k (opposite vertex k)
+    float a[3], b[3];    // E_k(p) = b*(p.y-oy) + a*(p.x-ox), positive inside
+    bool topLeft[3];     // E_k==0 still counts as inside
+    float invArea;       // E_k*invArea is the barycentric weight of vertex k
+    bool valid;          // false for zero-area triangles, which draw nothing
+};
+
+inline EdgeFunctions setupEdges(const glm::vec2 &p0,const glm::vec2 &p1,const glm::vec2 &p2){
+    EdgeFunctions e;
+    float area = (p2.x-p1.x)*(p0.y-p1.y) - (p2.y-p1.y)*(p0.x-p1.x);
+    e.valid = area!=0.0f && std::isfinite(area);
+    e.invArea = e.valid ? 1.0f/std::abs(area) : 0.0f;
+    float orient = area<0.0f ? -1.0f : 1.0f;
+    const glm::vec2* v[3] = {&p0,&p1,&p2};
+    for(int k=0;k<3;k++){
+        glm::vec2 from = *v[(k+1)%3], to = *v[(k+2)%3];
+        float s = orient;
+        if(to.x<from.x || (to.x==from.x && to.y<from.y)){ std::swap(from,to); s = -s; }
+        e.ox[k] = from.x; e.oy[k] = from.y;
+        e.a[k] = -s*(to.y-from.y);
+        e.b[k] =  s*(to.x-from.x);
+        // Left edges face +x, top edges are horizontal and face +y (down)
+        e.topLeft[k] = e.a[k]>0.0f || (e.a[k]==0.0f && e.b[k]>0.0f);
+    }
+    return e;
+}
+
+inline float edgeAt(const EdgeFunctions &e,int k,float px,float py){
+    return e.b[k]*(py-e.oy[k]) + e.a[k]*(px-e.ox[k]);
+}
+
+// Barycentric weights at the centre of pixel (x,y)
+inline glm::vec3 edgeWeights(const EdgeFunctions &e,int x,int y){
+    float px = float(x)+0.5f, py = float(y)+0.5f;
+    return glm::vec3(edgeAt(e,0,px,py), edgeAt(e,1,px,py), edgeAt(e,2,px,py))*e.invArea;
+}
+
+// True if every pixel centre of the 8x8 block at (x0,y0) is outside one edge.
+// Tests the block corner where that edge is largest, with a small margin so
+// rounding can never reject a covered pixel.
+inline bool blockOutside(const EdgeFunctions &e,int x0,int y0){
+    for(int k=0;k<3;k++){
+        float px = float(x0) + (e.a[k]>0.0f ? 7.5f : 0.5f);
+        float py = float(y0) + (e.b[k]>0.0f ? 7.5f : 0.5f);
+        if(edgeAt(e,k,px,py) < -1e-3f*(std::abs(e.a[k])+std::abs(e.b[k]))) return true;
+    }
+    return false;
+}
+
+// Bit r*8+c set for block pixels with c in [c0,c1] and r in [r0,r1]
+inline uint64_t blockRangeMask(int c0,int c1,int r0,int r1){
+    c0=std::max(c0,0); c1=std::min(c1,7); r0=std::max(r0,0); r1=std::min(r1,7);
+    if(c0>c1 || r0>r1) return 0;
+    uint64_t row = (0xFFu>>(7-c1)) & (0xFFu<<c0) & 0xFFu;
+    uint64_t mask = 0;
+    for(int r=r0;r<=r1;r++) mask |= row<<(r*8);
+    return mask;
+}
+
+inline int bitCount(uint64_t mask){
+#if defined(__GNUC__)
+    return __builtin_popcountll(mask);
+#else
+    int n = 0;
+    for(; mask; mask&=mask-1) n++;
+    return n;
+#endif
+}
+
+inline int lowestBit(uint64_t mask){
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    int bit = 0;
+    while(!(mask&1)){ mask >>= 1; bit++; }
+    return bit;
+#endif
+}
+
+// ---------- COVERAGE KERNELS ----------
+// Each returns the covered pixels of the 8x8 block at (x0,y0), bit r*8+c.
+// All of them compute E_k exactly like edgeAt, so their masks are identical:
+// the column terms a*(px-ox) once per block, the row term b*(py-oy) once per
+// row, leaving one add per pixel and edge. When values is set they also store
+// the E_k of the covered rows, so the rasterizer's weights need no second
+// evaluation.
+
+struct BlockEdges { float E[3][64]; };   // [k][r*8+c]
+
+typedef uint64_t (*CoverageKernel)(const EdgeFunctions &e,int x0,int y0,BlockEdges *values);
+
+// Along a row E_k only moves one way, rounding included (both terms are
+// monotonic in px), so an edge that passes or fails at both ends of a row
+// does so at every pixel between them: only rows an edge actually crosses
+// are tested pixel by pixel.
+inline uint64_t coverBlockScalar(const EdgeFunctions &e,int x0,int y0,BlockEdges *values){
+    float colTerm[3][8];
+    for(int k=0;k<3;k++)
+        for(int c=0;c<8;c++){
+            float px = float(x0+c)+0.5f;
+            colTerm[k][c] = e.a[k]*(px-e.ox[k]);
+        }
+    auto inside = [&](int k,float E){ return E>0.0f || (E==0.0f && e.topLeft[k]); };
+    uint64_t mask = 0;
+    for(int r=0;r<8;r++){
+        float py = float(y0+r)+0.5f;
+        float rowTerm[3];
+        uint32_t rowMask = 0xFF;
+        for(int k=0;k<3 && rowMask;k++){
+            rowTerm[k] = e.b[k]*(py-e.oy[k]);
+            bool first = inside(k,rowTerm[k]+colTerm[k][0]), last = inside(k,rowTerm[k]+colTerm[k][7]);
+            if(first && last) continue;
+            uint32_t in = 0;
+            if(first || last)
+                for(int c=0;c<8;c++) in |= uint32_t(inside(k,rowTerm[k]+colTerm[k][c]))<<c;
+            rowMask &= in;
+        }
+        if(values && rowMask)
+            for(int k=0;k<3;k++)
+                for(int c=0;c<8;c++) values->E[k][r*8+c] = rowTerm[k]+colTerm[k][c];
+        mask |= uint64_t(rowMask)<<(r*8);
+    }
+    return mask;
+}
+
+#ifdef RASTER_X86
+__attribute__((target("sse2")))
+inline uint64_t coverBlockSSE(const EdgeFunctions &e,int x0,int y0,BlockEdges *values){
+    const __m128 zero = _mm_setzero_ps();
+    __m128 colTerm[3][2], topLeft[3];
+    for(int k=0;k<3;k++){
+        for(int h=0;h<2;h++){
+            __m128 px = _mm_add_ps(_mm_add_ps(_mm_set1_ps(float(x0+4*h)), _mm_setr_ps(0,1,2,3)), _mm_set1_ps(0.5f));
+            colTerm[k][h] = _mm_mul_ps(_mm_set1_ps(e.a[k]), _mm_sub_ps(px,_mm_set1_ps(e.ox[k])));
+        }
+        topLeft[k] = _mm_castsi128_ps(_mm_set1_epi32(e.topLeft[k] ? -1 : 0));
+    }
+    uint64_t mask = 0;
+    for(int r=0;r<8;r++){
+        float py = float(y0+r)+0.5f;
+        for(int h=0;h<2;h++){
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for(int k=0;k<3;k++){
+                __m128 E = _mm_add_ps(_mm_set1_ps(e.b[k]*(py-e.oy[k])), colTerm[k][h]);
+                if(values) _mm_storeu_ps(&values->E[k][r*8+4*h], E);
+                __m128 in = _mm_or_ps(_mm_cmpgt_ps(E,zero), _mm_and_ps(_mm_cmpeq_ps(E,zero),topLeft[k]));
+                inside = _mm_and_ps(inside,in);
+            }
+            mask |= uint64_t(_mm_movemask_ps(inside))<<(r*8+4*h);
+        }
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+inline uint64_t coverBlockAVX2(const EdgeFunctions &e,int x0,int y0,BlockEdges *values){
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 px = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(float(x0)), _mm256_setr_ps(0,1,2,3,4,5,6,7)), _mm256_set1_ps(0.5f));
+    __m256 colTerm[3], topLeft[3];
+    for(int k=0;k<3;k++){
+        colTerm[k] = _mm256_mul_ps(_mm256_set1_ps(e.a[k]), _mm256_sub_ps(px,_mm256_set1_ps(e.ox[k])));
+        topLeft[k] = _mm256_castsi256_ps(_mm256_set1_epi32(e.topLeft[k] ? -1 : 0));
+    }
+    uint64_t mask = 0;
+    for(int r=0;r<8;r++){
+        float py = float(y0+r)+0.5f;
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for(int k=0;k<3;k++){
+            __m256 E = _mm256_add_ps(_mm256_set1_ps(e.b[k]*(py-e.oy[k])), colTerm[k]);
+            if(values) _mm256_storeu_ps(&values->E[k][r*8], E);
+            __m256 in = _mm256_or_ps(_mm256_cmp_ps(E,zero,_CMP_GT_OQ),
+                                     _mm256_and_ps(_mm256_cmp_ps(E,zero,_CMP_EQ_OQ),topLeft[k]));
+            inside = _mm256_and_ps(inside,in);
+        }
+        mask |= uint64_t(_mm256_movemask_ps(inside))<<(r*8);
+    }
+    return mask;
+}
+#endif
+
+enum RasterKernel { RASTER_SCALAR, RASTER_SSE, RASTER_AVX2, RASTER_KERNEL_COUNT };
+inline const char* rasterKernelNames[RASTER_KERNEL_COUNT] = {"scalar","sse","avx2"};
+
+// Null where the kernel is not compiled in or the CPU lacks it
+inline CoverageKernel rasterKernel(RasterKernel k){
+#ifdef RASTER_X86
+    __builtin_cpu_init();
+    if(k==RASTER_SSE && __builtin_cpu_supports("sse2")) return coverBlockSSE;
+    if(k==RASTER_AVX2 && __builtin_cpu_supports("avx2")) return coverBlockAVX2;
+#endif
+    return k==RASTER_SCALAR ? coverBlockScalar : nullptr;
+}
+
+inline RasterKernel bestRasterKernel(){
+    for(int k=RASTER_KERNEL_COUNT-1;k>0;k--)
+        if(rasterKernel(RasterKernel(k))) return RasterKernel(k);
+    return RASTER_SCALAR;
+}
+
+inline RasterKernel activeRasterKernel = bestRasterKernel();
+inline CoverageKernel coverBlock = rasterKernel(activeRasterKernel);
+
+// --verify-raster: every available kernel must match the scalar one, coverage
+// may only differ from barycentric() for pixel centres practically on an
+// edge, and a fan tiling a square must cover each pixel exactly once.
+// Finishes with a fill-rate comparison on one large triangle.
+inline int verifyRaster(int width,int height){
+    const int SIZE = 256;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> coord(-16.0f, SIZE+16.0f);
+    // Half of the vertices sit on the half-pixel grid so that many pixel
+    // centres land exactly on edges
+    auto randomPoint = [&](){
+        glm::vec2 p(coord(rng),coord(rng));
+        if(rng()&1) p = glm::vec2(std::floor(p.x*2.0f), std::floor(p.y*2.0f))*0.5f;
+        return p;
+    };
+    auto forEachBlock = [&](const glm::vec2 &p0,const glm::vec2 &p1,const glm::vec2 &p2,auto fn){
+        int minX=std::max(0,int(std::floor(std::min({p0.x,p1.x,p2.x})))), maxX=std::min(SIZE-1,int(std::ceil(std::max({p0.x,p1.x,p2.x}))));
+        int minY=std::max(0,int(std::floor(std::min({p0.y,p1.y,p2.y})))), maxY=std::min(SIZE-1,int(std::ceil(std::max({p0.y,p1.y,p2.y}))));
+        for(int by=minY&~7; by<=maxY; by+=8)
+            for(int bx=minX&~7; bx<=maxX; bx+=8)
+                fn(bx,by,blockRangeMask(minX-bx,maxX-bx,minY-by,maxY-by));
+    };
+
+    CoverageKernel kernels[RASTER_KERNEL_COUNT];
+    for(int k=0;k<RASTER_KERNEL_COUNT;k++) kernels[k] = rasterKernel(RasterKernel(k));
+
+    long kernelMismatches=0, referenceMismatches=0, rejectedCovered=0;
+    for(int i=0;i<20000;i++){
+        glm::vec2 p0=randomPoint(), p1=randomPoint(), p2=randomPoint();
+        EdgeFunctions e = setupEdges(p0,p1,p2);
+        if(!e.valid) continue;
+        forEachBlock(p0,p1,p2,[&](int bx,int by,uint64_t range){
+            uint64_t scalar = coverBlockScalar(e,bx,by,nullptr) & range;
+            for(int k=1;k<RASTER_KERNEL_COUNT;k++)
+                if(kernels[k]) kernelMismatches += (kernels[k](e,bx,by,nullptr)&range)!=scalar;
+            if(scalar && blockOutside(e,bx,by)) rejectedCovered++;
+            for(int bit=0;bit<64;bit++){
+                if(!(range>>bit&1)) continue;
+                int x=bx+(bit&7), y=by+(bit>>3);
+                glm::vec3 bc = barycentric(glm::vec2(x+0.5f,y+0.5f),p0,p1,p2);
+                bool reference = bc.x>=0 && bc.y>=0 && bc.z>=0;
+                if(reference==bool(scalar>>bit&1)) continue;
+                float distance = 1e30f;
+                for(int k=0;k<3;k++)
+                    distance = std::min(distance, std::abs(edgeAt(e,k,x+0.5f,y+0.5f))/std::hypot(e.a[k],e.b[k]));
+                if(distance>1e-3f) referenceMismatches++;
+            }
+        });
+    }
+
+    // Fans from a random interior point to random points along the square's
+    // border: the triangles tile the square, and no pixel centre lies on its
+    // border, so every pixel must be covered exactly once
+    long overlaps=0, holes=0;
+    std::vector<int> hits(SIZE*SIZE);
+    std::uniform_int_distribution<int> gridCoord(1, 2*SIZE-1);
+    for(int fan=0;fan<200;fan++){
+        std::fill(hits.begin(), hits.end(), 0);
+        glm::vec2 center(gridCoord(rng)*0.5f, gridCoord(rng)*0.5f);
+        std::vector<glm::vec2> ring;
+        const glm::vec2 corners[4] = {{0,0},{float(SIZE),0},{float(SIZE),float(SIZE)},{0,float(SIZE)}};
+        for(int side=0;side<4;side++){
+            glm::vec2 a=corners[side], b=corners[(side+1)%4];
+            std::vector<float> ts = {0.0f};
+            for(int n=rng()%6;n>0;n--) ts.push_back(gridCoord(rng)*0.5f/SIZE);
+            std::sort(ts.begin(), ts.end());
+            for(float tt : ts) ring.push_back(a+(b-a)*tt);
+        }
+        for(size_t i=0;i<ring.size();i++){
+            glm::vec2 p1 = ring[i], p2 = ring[(i+1)%ring.size()];
+            EdgeFunctions e = setupEdges(center,p1,p2);
+            if(!e.valid) continue;
+            forEachBlock(center,p1,p2,[&](int bx,int by,uint64_t range){
+                if(blockOutside(e,bx,by)) return;
+                for(uint64_t mask=coverBlock(e,bx,by,nullptr)&range; mask; mask&=mask-1){
+                    int bit = lowestBit(mask);
+                    hits[(by+(bit>>3))*SIZE + bx+(bit&7)]++;
+                }
+            });
+        }
+        for(int h : hits){ overlaps += h>1; holes += h==0; }
+    }
+
+    std::cout << "Raster kernels:";
+    for(int k=0;k<RASTER_KERNEL_COUNT;k++)
+        if(kernels[k]) std::cout << " " << rasterKernelNames[k];
+    std::cout << " (active: " << rasterKernelNames[activeRasterKernel] << ")\n"
+              << "  kernel mismatches:    " << kernelMismatches << "\n"
+              << "  reference mismatches: " << referenceMismatches << "\n"
+              << "  wrongly rejected:     " << rejectedCovered << "\n"
+              << "  fan overlaps / holes: " << overlaps << " / " << holes << "\n";
+
+    // Fill rate over a triangle covering half a width x height window
+    glm::vec2 p0(0.0f,0.0f), p1(width,0.0f), p2(0.0f,height);
+    EdgeFunctions e = setupEdges(p0,p1,p2);
+    const int reps = 50;
+    auto timeIt = [&](auto fn){
+        Uint64 start = SDL_GetPerformanceCounter();
+        long covered = 0;
+        for(int r=0;r<reps;r++) covered += fn();
+        double s = double(SDL_GetPerformanceCounter()-start)/SDL_GetPerformanceFrequency();
+        return covered/s/1e6;
+    };
+    std::cout << "  fill rate barycentric: " << timeIt([&](){
+        long n = 0;
+        for(int y=0;y<height;y++)
+            for(int x=0;x<width;x++){
+                glm::vec3 bc = barycentric(glm::vec2(x+0.5f,y+0.5f),p0,p1,p2);
+                n += bc.x>=0 && bc.y>=0 && bc.z>=0;
+            }
+        return n;
+    }) << " Mpix/s\n";
+    for(int k=0;k<RASTER_KERNEL_COUNT;k++){
+        CoverageKernel kernel = kernels[k];
+        if(!kernel) continue;
+        std::cout << "  fill rate " << rasterKernelNames[k] << ": " << timeIt([&](){
+            long n = 0;
+            for(int by=0;by<height;by+=8)
+                for(int bx=0;bx<width;bx+=8){
+                    if(blockOutside(e,bx,by)) continue;
+                    n += bitCount(kernel(e,bx,by,nullptr));
+                }
+            return n;
+        }) << " Mpix/s\n";
+    }
+
+    bool ok = !kernelMismatches && !referenceMismatches && !rejectedCovered && !overlaps && !holes;
+    std::cout << (ok ? "Raster check passed" : "Raster check FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
+
+// ---------- SHADOW MAP PASS ----------
+// Renders shadowMap's depth with the same edge functions and coverage kernel
+// as the frame. Faces are set up once and binned to the bands of rows their
+// y-extent touches, so each band's worker only visits faces that reach it.
+// Faces crossing the plane through the light are cut at a near plane first,
+// like clipFace does for the camera, so a tall occluder that extends past
+// the light still casts the part of its shadow in front of it.
+
+#define SHADOW_MAP_BAND 32
+
+struct ShadowTriangle {
+    EdgeFunctions edges;
+    glm::vec3 invW;                  // 1/distance per corner, affine in texel space
+    int minX, maxX, minY, maxY;      // texel bounds, clamped to the map
+};
+
+// Appends the triangle with texel corners l0..l2 (x, y, distance) if it
+// covers any of the map
+inline void addShadowTriangle(std::vector<ShadowTriangle> &out,const glm::vec3 &l0,const glm::vec3 &l1,const glm::vec3 &l2){
+    ShadowTriangle t;
+    t.minX=std::max(0,int(std::floor(std::min({l0.x,l1.x,l2.x}))));
+    t.maxX=std::min(SHADOW_MAP_SIZE-1,int(std::ceil(std::max({l0.x,l1.x,l2.x}))));
+    t.minY=std::max(0,int(std::floor(std::min({l0.y,l1.y,l2.y}))));
+    t.maxY=std::min(SHADOW_MAP_SIZE-1,int(std::ceil(std::max({l0.y,l1.y,l2.y}))));
+    if(t.minX>t.maxX || t.minY>t.maxY) return;
+    t.edges = setupEdges(glm::vec2(l0),glm::vec2(l1),glm::vec2(l2));
+    if(!t.edges.valid) return;
+    t.invW = glm::vec3(1.0f/l0.z, 1.0f/l1.z, 1.0f/l2.z);
+    out.push_back(t);
+}
+
+inline void renderShadowMap(const Model &model){
+    if(model.vertices.empty() || (shadowMap.valid && shadowMap.light==lightPos)) return;
+    ProfileScope scope(STAGE_SHADOW_MAP);
+    shadowMap.valid = true;
+    shadowMap.light = lightPos;
+    glm::vec3 center = (model.boundsMin+model.boundsMax)*0.5f;
+    float radius = glm::length(model.boundsMax-center);
+
+    // Perspective frustum from the light that just contains the bounding sphere
+    glm::vec3 dir = glm::normalize(center-lightPos);
+    glm::vec3 up = std::abs(dir.y)<0.9f ? glm::vec3(0,1,0) : glm::vec3(0,0,1);
+    float dist = glm::length(center-lightPos);
+    float halfFov = dist>radius ? std::asin(radius/dist) : 1.3f;
+    shadowMap.view = glm::lookAt(lightPos, center, up);
+    shadowMap.focal = (SHADOW_MAP_SIZE/2.0f)/std::tan(std::min(halfFov,1.3f));
+    // Closer than this to the light, texel coordinates lose too much
+    // precision for the edge functions
+    const float nearW = std::max(1e-4f, 1e-3f*radius);
+    auto toTexel = [&](const glm::vec3 &r){
+        float w = -r.z;
+        return glm::vec3(SHADOW_MAP_SIZE/2.0f + shadowMap.focal*r.x/w,
+                         SHADOW_MAP_SIZE/2.0f - shadowMap.focal*r.y/w, w);
+    };
+
+    shadowMap.lightVerts.resize(model.vertices.size());
+    const int chunk = 4096;
+    int vertexCount = model.vertices.size();
+    parallelFor((vertexCount+chunk-1)/chunk, [&](int c){
+        int end = std::min(vertexCount,(c+1)*chunk);
+        for(int i=c*chunk;i<end;i++){
+            glm::vec4 lv = shadowMap.view*glm::vec4(model.vertices[i],1.0f);
+            shadowMap.lightVerts[i] = toTexel(glm::vec3(lv.x, lv.y, std::min(lv.z,-1e-6f)));
+        }
+    });
+
+    // Triangle setup per chunk of faces, in face order
+    int faceCount = model.faces.size();
+    int chunks = (faceCount+chunk-1)/chunk;
+    std::vector<std::vector<ShadowTriangle>> triangles(chunks);
+    parallelFor(chunks, [&](int c){
+        int end = std::min(faceCount,(c+1)*chunk);
+        triangles[c].reserve(end-c*chunk);
+        for(int i=c*chunk;i<end;i++){
+            const auto &f = model.faces[i];
+            const glm::vec3 &l0 = shadowMap.lightVerts[f[0]-1];
+            const glm::vec3 &l1 = shadowMap.lightVerts[f[1]-1];
+            const glm::vec3 &l2 = shadowMap.lightVerts[f[2]-1];
+            if(l0.z>=nearW && l1.z>=nearW && l2.z>=nearW){
+                addShadowTriangle(triangles[c],l0,l1,l2);
+                continue;
+            }
+            if(l0.z<nearW && l1.z<nearW && l2.z<nearW) continue; // behind the light
+
+            // Cut against the near plane in light view space, where w is
+            // linear, and fan the remaining corners (at most four)
+            glm::vec3 poly[4], r[3];
+            for(int k=0;k<3;k++) r[k] = glm::vec3(shadowMap.view*glm::vec4(model.vertices[f[k]-1],1.0f));
+            int n = 0;
+            for(int k=0;k<3;k++){
+                const glm::vec3 &p = r[k], &q = r[(k+1)%3];
+                float dp = -p.z-nearW, dq = -q.z-nearW;
+                if(dp>=0.0f) poly[n++] = p;
+                if((dp>=0.0f)!=(dq>=0.0f)) poly[n++] = p+(q-p)*(dp/(dp-dq));
+            }
+            for(int k=1;k+1<n;k++)
+                addShadowTriangle(triangles[c],toTexel(poly[0]),toTexel(poly[k]),toTexel(poly[k+1]));
+        }
+    });
+
+    const int bandCount = SHADOW_MAP_SIZE/SHADOW_MAP_BAND;
+    std::vector<std::vector<const ShadowTriangle*>> bands(bandCount);
+    for(const auto &list : triangles)
+        for(const auto &t : list)
+            for(int b=t.minY/SHADOW_MAP_BAND;b<=t.maxY/SHADOW_MAP_BAND;b++) bands[b].push_back(&t);
+
+    shadowMap.depth.assign(SHADOW_MAP_SIZE*SHADOW_MAP_SIZE, 1e30f);
+
+    // Each band of rows is owned by one worker, so no two threads share a texel
+    parallelFor(bandCount, [&](int b){
+        int bandMinY = b*SHADOW_MAP_BAND, bandMaxY = bandMinY+SHADOW_MAP_BAND-1;
+        BlockEdges values;
+        for(const ShadowTriangle* t : bands[b]){
+            const EdgeFunctions &e = t->edges;
+            int minY=std::max(bandMinY,t->minY), maxY=std::min(bandMaxY,t->maxY);
+            for(int by=minY&~7;by<=maxY;by+=8){
+                for(int bx=t->minX&~7;bx<=t->maxX;bx+=8){
+                    if(blockOutside(e,bx,by)) continue;
+                    uint64_t mask = coverBlock(e,bx,by,&values) & blockRangeMask(t->minX-bx,t->maxX-bx,minY-by,maxY-by);
+                    for(;mask;mask&=mask-1){
+                        int bit = lowestBit(mask);
+                        glm::vec3 bc = glm::vec3(values.E[0][bit], values.E[1][bit], values.E[2][bit])*e.invArea;
+                        // 1/distance is affine in light screen space
+                        float d = 1.0f/glm::dot(bc,t->invW);
+                        float &texel = shadowMap.depth[(by+(bit>>3))*SHADOW_MAP_SIZE + bx+(bit&7)];
+                        if(d<texel) texel = d;
+                    }
+                }
+            }
+        }
+    });
+}
+
+// ---------- CULLING ----------
+// Runs per face after vertex processing and before triangle setup, so a
+// rejected face never pays for setup. Only the backface test can
+// drop a face that would have drawn pixels, and only for materials whose
+// back side is never meant to be seen. Faces crossing the near or far plane
+// are kept as CULL_CLIPPED and cut by clipFace instead of being set up.
+// CULL_OCCLUDED is only assigned after rasterization, by the hierarchical Z test.
+enum CullResult { CULL_KEPT, CULL_CLIPPED, CULL_DEGENERATE, CULL_FRUSTUM, CULL_SMALL, CULL_BACKFACE, CULL_OCCLUDED, CULL_RESULT_COUNT };
+inline const char* cullResultNames[CULL_RESULT_COUNT] = {"kept","clipped","degenerate","frustum","small","backface","occluded"};
+
+inline bool cullingEnabled = true;
+
+// ---------- TRIANGLE SETUP ----------
+// Everything the pixel loop needs for one face, computed once so the serial
+// and tiled rasterizers shade from exactly the same values.
+
+// A corner as the rasterizer sees it: a face vertex, or for a face cut by the
+// near or far plane a point on one of its edges
+struct RasterVertex {
+    glm::vec2 p;          // window position
+    float depth;          // depth test value
+    float w;              // distance in front of the camera, 1 when orthographic
+    glm::vec3 weights;    // barycentric weights over the face's own vertices
+};
+
+struct TriangleSetup {
+    int faceIndex;
+    glm::vec2 p0,p1,p2;
+    float z0,z1,z2;         // depth test values, affine in screen space
+    glm::vec3 invW;         // 1/w per corner, for perspective-correct weights
+    glm::vec3 corner[3];    // clipped pieces: each corner's weights over the face
+    bool clipped;
+    bool perspective;       // weights need the 1/w correction
+    float zNear;            // no pixel of the triangle is nearer than this
+    glm::vec3 flatColor;    // flat and shadowed: lit material color, unused when textured
+    glm::vec3 c0,c1,c2;     // Gouraud: vertex colors
+    glm::vec3 ambient;      // shadow map: color of a shadowed pixel
+    glm::vec3 w0,w1,w2;     // shadow map: world positions for the per-pixel lookup
+    float shadowSlope;      // shadow map: depth bias factor for this face
+    float shadowOffset;     // shadow map: extra bias, the LOD's lodError
+    bool textured;
+    int texture;            // index into textures, -1 draws textured faces white
+    int minX,maxX,minY,maxY; // screen bounds, already clamped to the window
+    EdgeFunctions edges;
+};
+
+// ---------- FRAME CONTEXT ----------
+// Everything one frame is rendered from and into: its camera, its target and
+// the per-frame buffers of every stage. draw() changes nothing else, so
+// frames with their own contexts can be drawn at the same time (see the
+// frame-parallel batch in main.cpp). The window, the headless batch and the
+// benchmarks all draw mainFrame.
+struct FrameContext;
+
+typedef bool (*RasterizeFn)(const TriangleSetup&,const Model&,uint32_t*,float*,int,int,int,
+                            int,int,int,int,float*,int);
+typedef void (*ResolveFn)(FrameContext&,const Model&);
+
+struct ShadingKernel {
+    RasterizeFn rasterize;   // forward: shades every fragment that passes the depth test
+    ResolveFn resolve;       // deferred: shades every visible pixel once
+};
+
+struct FrameContext {
+    Camera camera;
+    Framebuffer framebuffer{640, 480};
+    FrameView view;
+    ShadingKernel kernel;    // picked by draw() for this frame
+
+    // Vertex processing output, indexed like the model's vertices
+    std::vector<glm::vec2> screenVerts;   // window position
+    std::vector<float> vertexDepth;       // depth test value
+    std::vector<float> vertexW;           // distance in front of the camera, 1 when orthographic
+    std::vector<float> vertexDiffuse;     // Gouraud: unshadowed N.L
+
+    std::atomic<long> cullCounts[CULL_RESULT_COUNT] = {}; // faces per result in this frame
+
+    std::vector<TriangleSetup> triangleSetups;  // indexed by visibility ids and tile bins
+    AlignedVector<uint32_t> visibilityBuffer;   // deferred: same layout as the framebuffer planes
+    std::vector<float> blockFar;                // serial path: hierarchical Z over the framebuffer
+
+    // Tiled path
+    std::vector<uint8_t> faceCull;                // CullResult of each face
+    std::vector<std::atomic<bool>> setupReached;  // some tile rasterized the setup past hierarchical Z
+    std::vector<std::vector<int>> tileBins;
+};
+
+inline FrameContext mainFrame;
+
+// ---------- VERTEX PROCESSING ----------
+// Runs once per frame before triangle setup. The view rotation is built once
+// and every unique vertex is projected (and for Gouraud, lit) exactly once,
+// so a vertex shared by several faces is no longer redone for each of them.
+// Triangle setup just indexes these buffers by the face's vertex numbers.
+inline void processVertices(FrameContext &fc,const Model &model){
+    ProfileScope scope(STAGE_VERTICES);
+    fc.view = makeFrameView(fc.camera,fc.framebuffer);
+    const FrameView &view = fc.view;
+    int vertexCount = model.vertices.size();
+    fc.screenVerts.resize(vertexCount);
+    fc.vertexDepth.resize(vertexCount);
+    fc.vertexW.resize(vertexCount);
+    bool gouraud = shadingMode==SHADING_GOURAUD;
+    if(gouraud) fc.vertexDiffuse.resize(vertexCount);
+
+    const int chunk = 4096;
+    parallelFor((vertexCount+chunk-1)/chunk, [&](int c){
+        int end = std::min(vertexCount,(c+1)*chunk);
+        for(int i=c*chunk;i<end;i++){
+            const glm::vec3 &v = model.vertices[i];
+            glm::vec3 r = toView(view,v);
+            fc.vertexW[i] = viewW(view,r);
+            fc.screenVerts[i] = projectView(view,r,fc.vertexW[i],fc.vertexDepth[i]);
+            if(gouraud) fc.vertexDiffuse[i] = std::max(0.0f, glm::dot(glm::normalize(model.vertexNormals[i]), glm::normalize(lightPos-v)));
+        }
+    });
+}
+
+inline CullResult cullFace(FrameContext &fc,int faceIndex,const Model &model){
+    const auto &f = model.faces[faceIndex];
+    bool cullBackfaces = model.materials[model.faceMaterials[faceIndex]].cullBackfaces;
+    if(fc.view.perspective){
+        float w0 = fc.vertexW[f[0]-1], w1 = fc.vertexW[f[1]-1], w2 = fc.vertexW[f[2]-1];
+        bool outside = std::max({w0,w1,w2})<nearPlane || std::min({w0,w1,w2})>farPlane;
+        if(outside && cullingEnabled) return CULL_FRUSTUM;
+        if(std::min({w0,w1,w2})<nearPlane || std::max({w0,w1,w2})>farPlane){
+            // Screen positions are meaningless behind the camera: test the side in view space
+            glm::vec3 r0 = toView(fc.view,model.vertices[f[0]-1]);
+            glm::vec3 r1 = toView(fc.view,model.vertices[f[1]-1]);
+            glm::vec3 r2 = toView(fc.view,model.vertices[f[2]-1]);
+            glm::vec3 eye(0.0f,0.0f,fc.view.distance);
+            if(cullingEnabled && cullBackfaces && glm::dot(glm::cross(r1-r0,r2-r0),eye-r0)<0.0f) return CULL_BACKFACE;
+            return CULL_CLIPPED;
+        }
+    }
+    if(!cullingEnabled) return CULL_KEPT;
+
+    const glm::vec2 &p0 = fc.screenVerts[f[0]-1];
+    const glm::vec2 &p1 = fc.screenVerts[f[1]-1];
+    const glm::vec2 &p2 = fc.screenVerts[f[2]-1];
+
+    float area = (p1.x-p0.x)*(p2.y-p0.y) - (p1.y-p0.y)*(p2.x-p0.x);
+    if(area==0.0f || !std::isfinite(area)) return CULL_DEGENERATE;
+
+    float minX=std::min({p0.x,p1.x,p2.x}), maxX=std::max({p0.x,p1.x,p2.x});
+    float minY=std::min({p0.y,p1.y,p2.y}), maxY=std::max({p0.y,p1.y,p2.y});
+    if(maxX<0.0f || minX>fc.framebuffer.width || maxY<0.0f || minY>fc.framebuffer.height) return CULL_FRUSTUM;
+
+    // No pixel centre x+0.5 (or y+0.5) inside the bounds, so nothing to cover
+    if(std::ceil(minX-0.5f)>std::floor(maxX-0.5f) || std::ceil(minY-0.5f)>std::floor(maxY-0.5f))
+        return CULL_SMALL;
+
+    // Counter-clockwise faces (seen from +z) turn clockwise on screen, where y points down
+    if(area>0.0f && cullBackfaces) return CULL_BACKFACE;
+    return CULL_KEPT;
+}
+
+inline void printCullCounts(std::ostream &out,const FrameContext &fc,int frames){
+    const std::atomic<long>* cullCounts = fc.cullCounts;
+    long total = 0;
+    for(int r=0;r<CULL_RESULT_COUNT;r++) total += cullCounts[r];
+    long culled = total-cullCounts[CULL_KEPT]-cullCounts[CULL_CLIPPED];
+    out << "Culled " << culled << " of " << total << " faces (" << (total ? 100.0*culled/total : 0.0) << "%)";
+    if(frames>1) out << " over " << frames << " frames";
+    out << ":";
+    for(int r=CULL_DEGENERATE;r<CULL_RESULT_COUNT;r++)
+        out << " " << cullResultNames[r] << " " << cullCounts[r];
+    if(cullCounts[CULL_CLIPPED]) out << " (" << cullCounts[CULL_CLIPPED] << " clipped)";
+    out << "\n";
+}
+
+// Lighting and shading inputs always come from the whole face; only the
+// rasterized geometry comes from rv, which is the face itself unless clipped
+inline TriangleSetup setupTriangle(FrameContext &fc,int faceIndex,const Model &model,const RasterVertex (&rv)[3],bool clipped){
+    TriangleSetup t;
+    t.faceIndex = faceIndex;
+
+    const auto &f = model.faces[faceIndex];
+    const glm::vec3 &v0 = model.vertices[f[0]-1];
+    const glm::vec3 &v1 = model.vertices[f[1]-1];
+    const glm::vec3 &v2 = model.vertices[f[2]-1];
+
+    t.p0=rv[0].p;
+    t.p1=rv[1].p;
+    t.p2=rv[2].p;
+
+    t.minX=std::floor(std::min({t.p0.x,t.p1.x,t.p2.x}));
+    t.maxX=std::ceil (std::max({t.p0.x,t.p1.x,t.p2.x}));
+    t.minY=std::floor(std::min({t.p0.y,t.p1.y,t.p2.y}));
+    t.maxY=std::ceil (std::max({t.p0.y,t.p1.y,t.p2.y}));
+
+    t.minX=std::max(0,t.minX); t.maxX=std::min(fc.framebuffer.width-1,t.maxX);
+    t.minY=std::max(0,t.minY); t.maxY=std::min(fc.framebuffer.height-1,t.maxY);
+    t.edges=setupEdges(t.p0,t.p1,t.p2);
+
+    t.z0=rv[0].depth; t.z1=rv[1].depth; t.z2=rv[2].depth;
+    t.invW=glm::vec3(1.0f/rv[0].w, 1.0f/rv[1].w, 1.0f/rv[2].w);
+    t.clipped=clipped;
+    t.perspective=fc.view.perspective;
+    for(int k=0;k<3;k++) t.corner[k]=rv[k].weights;
+    // Interpolated depth peaks at a corner; the margin covers its rounding
+    t.zNear=std::max({t.z0,t.z1,t.z2}) + 1e-5f*(std::abs(t.z0)+std::abs(t.z1)+std::abs(t.z2));
+
+    bool shadows = shadingMode!=SHADING_FLAT;
+    int shadowFace = model.faceSources.empty() ? faceIndex : model.faceSources[faceIndex]; // LODs share the full model's cache
+    bool shadowed = shadows && shadowMode==SHADOW_RAY && shadowCache.shadowed[shadowFace];
+
+    const Material &material = model.materials[model.faceMaterials[faceIndex]];
+    t.textured = material.textured;
+    t.texture = material.texture;
+    if(shadingMode==SHADING_GOURAUD){
+        t.c0 = material.Kd * (ambientLight + (shadowed?0.0f: fc.vertexDiffuse[f[0]-1]));
+        t.c1 = material.Kd * (ambientLight + (shadowed?0.0f: fc.vertexDiffuse[f[1]-1]));
+        t.c2 = material.Kd * (ambientLight + (shadowed?0.0f: fc.vertexDiffuse[f[2]-1]));
+    }
+    else if(!t.textured){
+        glm::vec3 n = faceNormal(v0,v1,v2);
+        float diffuse = std::max(0.0f, glm::dot(n, glm::normalize(lightPos-(v0+v1+v2)/3.0f)));
+        float lightFactor = ambientLight;
+        if(!shadowed) lightFactor += (1.0f-ambientLight)*diffuse;
+        t.flatColor = material.Kd * lightFactor;
+    }
+
+    t.ambient = material.Kd * ambientLight;
+    t.w0=v0; t.w1=v1; t.w2=v2;
+    if(shadows && shadowMode==SHADOW_MAP){
+        glm::vec3 fn = faceNormal(v0,v1,v2);
+        float cosTheta = std::max(0.1f, std::abs(glm::dot(fn, glm::normalize(lightPos-(v0+v1+v2)/3.0f))));
+        t.shadowSlope = std::sqrt(1.0f-cosTheta*cosTheta)/cosTheta;
+        t.shadowOffset = model.lodError;
+    }
+    return t;
+}
+
+// Setup for a whole face, straight from the vertex processing buffers
+inline TriangleSetup setupTriangle(FrameContext &fc,int faceIndex,const Model &model){
+    const auto &f = model.faces[faceIndex];
+    RasterVertex rv[3];
+    for(int k=0;k<3;k++){
+        int v = f[k]-1;
+        rv[k] = {fc.screenVerts[v], fc.vertexDepth[v], fc.vertexW[v], glm::vec3(0.0f)};
+        rv[k].weights[k] = 1.0f;
+    }
+    return setupTriangle(fc,faceIndex,model,rv,false);
+}
+
+// ---------- NEAR/FAR CLIPPING ----------
+// Cuts a CULL_CLIPPED face against the near and far planes in view space,
+// where w is linear, and fans what is left (at most five corners) into up to
+// three pieces. Returns the number of pieces written.
+inline int clipFace(FrameContext &fc,int faceIndex,const Model &model,TriangleSetup (&pieces)[3]){
+    struct ClipVertex { glm::vec3 r; float w; glm::vec3 weights; };
+    const auto &f = model.faces[faceIndex];
+    ClipVertex poly[8], next[8];
+    int n = 3;
+    for(int k=0;k<3;k++){
+        poly[k].r = toView(fc.view,model.vertices[f[k]-1]);
+        poly[k].w = viewW(fc.view,poly[k].r);
+        poly[k].weights = glm::vec3(0.0f);
+        poly[k].weights[k] = 1.0f;
+    }
+
+    for(int plane=0;plane<2 && n>0;plane++){
+        auto inside = [&](const ClipVertex &c){ return plane==0 ? c.w-nearPlane : farPlane-c.w; };
+        int m = 0;
+        for(int k=0;k<n;k++){
+            const ClipVertex &a = poly[k], &b = poly[(k+1)%n];
+            float da = inside(a), db = inside(b);
+            if(da>=0.0f) next[m++] = a;
+            if((da>=0.0f)!=(db>=0.0f)){
+                float s = da/(da-db);
+                next[m++] = {a.r+(b.r-a.r)*s, a.w+(b.w-a.w)*s, a.weights+(b.weights-a.weights)*s};
+            }
+        }
+        std::copy(next,next+m,poly);
+        n = m;
+    }
+
+    int count = 0;
+    for(int k=1;k+1<n;k++){
+        RasterVertex rv[3];
+        const ClipVertex* c[3] = {&poly[0],&poly[k],&poly[k+1]};
+        for(int j=0;j<3;j++){
+            rv[j].w = c[j]->w;
+            rv[j].p = projectView(fc.view,c[j]->r,c[j]->w,rv[j].depth);
+            rv[j].weights = c[j]->weights;
+        }
+        pieces[count++] = setupTriangle(fc,faceIndex,model,rv,true);
+    }
+    return count;
+}
+
+// Weights over the face's vertices at a pixel with screen-space weights bc:
+// perspective-correct, and mapped back from a clipped piece to its face
+inline glm::vec3 faceWeights(const TriangleSetup &t,const glm::vec3 &bc){
+    if(!t.perspective) return bc;
+    glm::vec3 w = bc*t.invW;
+    w /= w.x+w.y+w.z;
+    if(t.clipped) w = t.corner[0]*w.x + t.corner[1]*w.y + t.corner[2]*w.z;
+    return w;
+}
+
+// Texture color of the pixel with screen-space weights bc inside t. The mip
+// level comes from the UVs one pixel across and one down, which the weight
+// gradients of the edge functions give without touching the neighbours.
+inline glm::vec3 textureColor(const TriangleSetup &t,const glm::vec3 &bc,const Model &model){
+    const auto &uvs = model.faceUVs[t.faceIndex];
+    auto uvAt = [&](const glm::vec3 &w){
+        glm::vec3 fw = faceWeights(t,w);
+        return fw.x*uvs[0] + fw.y*uvs[1] + fw.z*uvs[2];
+    };
+    glm::vec2 uv = uvAt(bc);
+    if(textureFilter==FILTER_NEAREST) return sampleTexture(t.texture, uv, 0.0f);
+    const EdgeFunctions &e = t.edges;
+    glm::vec3 dx = glm::vec3(e.a[0],e.a[1],e.a[2])*e.invArea;
+    glm::vec3 dy = glm::vec3(e.b[0],e.b[1],e.b[2])*e.invArea;
+    return sampleTexture(t.texture, uv, textureLod(t.texture, uvAt(bc+dx)-uv, uvAt(bc+dy)-uv));
+}
+
+// Color of the pixel with screen-space weights bc inside t. Forward
+// rendering calls it for every fragment that passes the depth test; the
+// deferred resolve calls it once per visible pixel. MODE and SHADOW_LOOKUP
+// (the per-pixel shadow map test) are compile-time, so every instantiation
+// is straight-line code apart from the textured check.
+template<ShadingMode MODE,bool SHADOW_LOOKUP>
+uint32_t shadeFragment(const TriangleSetup &t,const glm::vec3 &bc,const Model &model){
+    glm::vec3 c;
+    if(t.textured)
+        c = textureColor(t, bc, model);
+    else{
+        glm::vec3 fw = faceWeights(t,bc);
+        if constexpr(SHADOW_LOOKUP){
+            if(!litByShadowMap(fw.x*t.w0 + fw.y*t.w1 + fw.z*t.w2, t.shadowSlope, t.shadowOffset)) c = t.ambient;
+            else if constexpr(MODE==SHADING_GOURAUD) c = fw.x*t.c0 + fw.y*t.c1 + fw.z*t.c2;
+            else c = t.flatColor;
+        }
+        else if constexpr(MODE==SHADING_GOURAUD) c = fw.x*t.c0 + fw.y*t.c1 + fw.z*t.c2;
+        else c = t.flatColor;
+    }
+
+    return (255<<24)
+         | (uint32_t(std::clamp(c.r,0.0f,1.0f)*255)<<16)
+         | (uint32_t(std::clamp(c.g,0.0f,1.0f)*255)<<8)
+         | uint32_t(std::clamp(c.b,0.0f,1.0f)*255);
+}
+
+// ---------- HIERARCHICAL Z ----------
+// Next to a depth target the rasterizer can keep blockFar: for every 8x8
+// block (aligned to the window), the farthest depth still stored in it. A
+// triangle whose zNear is farther than that cannot pass one depth test in
+// the block, so the block is skipped before any coverage work. The tiled
+// path adds a level above it, the farthest depth of the whole tile.
+inline bool hiZ = true;
+inline bool hiZSort = false;   // front-to-back order inside each tile bin
+
+// Farthest depth in the block at (bx,by), over the pixels the clip rectangle
+// lets the rasterizer write
+inline float blockFarDepth(const float* depth,int stride,int originX,int originY,int bx,int by,
+                    int clipMinX,int clipMaxX,int clipMinY,int clipMaxY){
+    int x0=std::max(bx,clipMinX), x1=std::min(bx+7,clipMaxX);
+    int y0=std::max(by,clipMinY), y1=std::min(by+7,clipMaxY);
+    float farthest = 1e30f;
+    for(int y=y0;y<=y1;y++)
+        for(int x=x0;x<=x1;x++)
+            farthest = std::min(farthest, depth[(y-originY)*stride + (x-originX)]);
+    return farthest;
+}
+
+// Rasterizes t into a color/depth target whose top-left pixel is
+// (originX,originY), writing only pixels inside the clip rectangle. With
+// blockFar (one float per 8x8 block of the target, row length
+// (stride+7)/8) occluded blocks are skipped and written blocks refreshed.
+// Returns false if every block was occluded. The VISIBILITY kernel writes
+// visibilityId instead of a color, into a visibility buffer.
+template<ShadingMode MODE,bool SHADOW_LOOKUP,bool VISIBILITY>
+bool rasterizeTriangle(const TriangleSetup &t,const Model &model,
+                       uint32_t* color,float* depth,int stride,int originX,int originY,
+                       int clipMinX,int clipMaxX,int clipMinY,int clipMaxY,
+                       float* blockFar,int visibilityId){
+    int minX=std::max(t.minX,clipMinX), maxX=std::min(t.maxX,clipMaxX);
+    int minY=std::max(t.minY,clipMinY), maxY=std::min(t.maxY,clipMaxY);
+    if(!t.edges.valid || minX>maxX || minY>maxY) return true;
+    const EdgeFunctions &e = t.edges;
+    int blockStride = (stride+7)/8;
+    bool reached = false;
+    long tested = 0, written = 0;
+    BlockEdges values;
+
+    for(int by=minY&~7;by<=maxY;by+=8){
+        for(int bx=minX&~7;bx<=maxX;bx+=8){
+            float* farthest = blockFar ? &blockFar[((by-originY)>>3)*blockStride + ((bx-originX)>>3)] : nullptr;
+            if(farthest && t.zNear<*farthest) continue;
+            reached = true;
+            if(blockOutside(e,bx,by)) continue;
+            uint64_t mask = coverBlock(e,bx,by,&values) & blockRangeMask(minX-bx,maxX-bx,minY-by,maxY-by);
+            bool wrote = false;
+            for(;mask;mask&=mask-1,tested++){
+                int bit = lowestBit(mask);
+                int x = bx+(bit&7), y = by+(bit>>3);
+                // Same E_k as edgeWeights(e,x,y), taken from the coverage test
+                glm::vec3 bc = glm::vec3(values.E[0][bit], values.E[1][bit], values.E[2][bit])*e.invArea;
+                float z = bc.x*t.z0 + bc.y*t.z1 + bc.z*t.z2;
+                int idx = (y-originY)*stride + (x-originX);
+                if(z>depth[idx]){
+                    depth[idx]=z;
+                    wrote = true;
+                    written++;
+                    if constexpr(VISIBILITY) color[idx] = uint32_t(visibilityId);
+                    else color[idx] = shadeFragment<MODE,SHADOW_LOOKUP>(t,bc,model);
+                }
+            }
+            if(farthest && wrote)
+                *farthest = blockFarDepth(depth,stride,originX,originY,bx,by,clipMinX,clipMaxX,clipMinY,clipMaxY);
+        }
+    }
+    profileCounts[COUNTER_PIXELS_TESTED] += tested;
+    profileCounts[COUNTER_PIXELS_WRITTEN] += written;
+    if(!VISIBILITY) profileCounts[COUNTER_PIXELS_SHADED] += written;
+    return reached;
+}
+
+// ---------- DEFERRED SHADING ----------
+// With deferredShading the raster passes only resolve visibility: every
+// pixel keeps its depth and, in visibilityBuffer, the index of the winning
+// setup. Weights are recomputed from that setup's edge functions, so nothing
+// else needs storing. resolveVisibility then shades each covered pixel
+// exactly once, so shading cost follows the window size, not the overdraw.
+#define NO_SETUP 0xFFFFFFFFu
+
+inline bool deferredShading = false;
+
+template<ShadingMode MODE,bool SHADOW_LOOKUP>
+void resolveVisibility(FrameContext &fc,const Model &model){
+    ProfileScope scope(STAGE_RESOLVE);
+    Framebuffer &fb = fc.framebuffer;
+    parallelFor(fb.height, [&](int y){
+        const uint32_t* ids = fc.visibilityBuffer.data() + size_t(y)*fb.stride;
+        uint32_t* color = fb.color.data() + size_t(y)*fb.stride;
+        for(int x=0;x<fb.width;x++){
+            if(ids[x]==NO_SETUP){ color[x] = 0u; continue; }
+            const TriangleSetup &t = fc.triangleSetups[ids[x]];
+            color[x] = shadeFragment<MODE,SHADOW_LOOKUP>(t, edgeWeights(t.edges,x,y), model);
+            profileCounts[COUNTER_PIXELS_SHADED]++;
+        }
+    });
+}
+
+// ---------- SHADING KERNELS ----------
+// The instantiations draw() can pick from. The shadowed mode only differs from
+// flat at setup unless it looks shadows up per pixel, so it shares the flat
+// kernel for ray shadows. The visibility pass does not shade at all and is
+// the same for every mode.
+template<ShadingMode MODE,bool SHADOW_LOOKUP>
+ShadingKernel makeShadingKernel(){
+    return { rasterizeTriangle<MODE,SHADOW_LOOKUP,false>, resolveVisibility<MODE,SHADOW_LOOKUP> };
+}
+
+const RasterizeFn rasterizeVisibility = rasterizeTriangle<SHADING_FLAT,false,true>;
+
+inline ShadingKernel selectShadingKernel(ShadingMode mode,bool shadowLookup){
+    switch(mode){
+        case SHADING_GOURAUD:
+            return shadowLookup ? makeShadingKernel<SHADING_GOURAUD,true>() : makeShadingKernel<SHADING_GOURAUD,false>();
+        case SHADING_SHADOWED:
+            if(shadowLookup) return makeShadingKernel<SHADING_SHADOWED,true>();
+            [[fallthrough]];
+        default:
+            return makeShadingKernel<SHADING_FLAT,false>();
+    }
+}
+
+inline bool drawTriangle(FrameContext &fc,const TriangleSetup &t,const Model &model){
+    int id = -1;
+    if(deferredShading){
+        id = fc.triangleSetups.size();
+        fc.triangleSetups.push_back(t);
+    }
+    Framebuffer &fb = fc.framebuffer;
+    RasterizeFn rasterize = deferredShading ? rasterizeVisibility : fc.kernel.rasterize;
+    return rasterize(t,model, deferredShading ? fc.visibilityBuffer.data() : fb.color.data(),
+                     fb.depth.data(),fb.stride,0,0,
+                     0,fb.width-1,0,fb.height-1,
+                     hiZ ? fc.blockFar.data() : nullptr, id);
+}
+
+inline void drawModel(FrameContext &fc,const Model &model){
+    ProfileScope scope(STAGE_RASTER); // setup is interleaved here, so it counts as raster time
+    TriangleSetup pieces[3];
+    for(size_t i=0;i<model.faces.size();i++){
+        CullResult r = cullFace(fc,i,model);
+        if(r==CULL_KEPT && !drawTriangle(fc,setupTriangle(fc,i,model),model)) r = CULL_OCCLUDED;
+        else if(r==CULL_CLIPPED)
+            for(int k=0,n=clipFace(fc,i,model,pieces);k<n;k++) drawTriangle(fc,pieces[k],model);
+        fc.cullCounts[r]++;
+    }
+}
+
+// ============================================================
+// =================== TILED RASTERIZER ========================
+// ============================================================
+
+// Faces are set up once, binned into screen tiles in face order, and every
+// tile is then rasterized by exactly one worker into its own color/depth
+// block. Per pixel the triangles arrive in the same order as in drawModel,
+// so the output is bit-identical to the serial path without any locking.
+
+#define TILE_SIZE 32
+#define TILES_X(fb) (((fb).width+TILE_SIZE-1)/TILE_SIZE)
+#define TILES_Y(fb) (((fb).height+TILE_SIZE-1)/TILE_SIZE)
+
+inline bool tiledRaster = true;   // false (--serial-raster, T key): drawModel instead
+
+// Culls and sets up every face, then bins the setups by tile
+inline void binTriangles(FrameContext &fc,const Model &model){
+    ProfileScope scope(STAGE_SETUP);
+    int faceCount = model.faces.size();
+    std::vector<TriangleSetup> &triangleSetups = fc.triangleSetups;
+    fc.triangleSetups.resize(faceCount);
+    fc.faceCull.resize(faceCount);
+    if(fc.setupReached.size()<size_t(faceCount)) fc.setupReached = std::vector<std::atomic<bool>>(faceCount);
+
+    // Setup (lighting, edge functions) in parallel chunks
+    const int chunk = 256;
+    parallelFor((faceCount+chunk-1)/chunk, [&](int c){
+        int end = std::min(faceCount,(c+1)*chunk);
+        long counts[CULL_RESULT_COUNT] = {};
+        for(int i=c*chunk;i<end;i++){
+            CullResult r = cullFace(fc,i,model);
+            counts[r]++;
+            fc.faceCull[i] = r;
+            fc.setupReached[i].store(false,std::memory_order_relaxed);
+            if(r==CULL_KEPT) triangleSetups[i] = setupTriangle(fc,i,model);
+        }
+        for(int r=0;r<CULL_RESULT_COUNT;r++) fc.cullCounts[r] += counts[r];
+    });
+
+    // Binning stays serial so every bin keeps face order. Clipped faces are
+    // cut here and their pieces appended after the per-face setups.
+    int tilesX = TILES_X(fc.framebuffer);
+    std::vector<std::vector<int>> &tileBins = fc.tileBins;
+    tileBins.resize(tilesX*TILES_Y(fc.framebuffer));
+    for(auto &bin : tileBins) bin.clear();
+    auto binSetup = [&](int s){
+        const TriangleSetup &t = triangleSetups[s];
+        if(t.minX>t.maxX || t.minY>t.maxY) return;
+        for(int ty=t.minY/TILE_SIZE; ty<=t.maxY/TILE_SIZE; ty++)
+            for(int tx=t.minX/TILE_SIZE; tx<=t.maxX/TILE_SIZE; tx++)
+                tileBins[ty*tilesX+tx].push_back(s);
+    };
+    TriangleSetup pieces[3];
+    for(int i=0;i<faceCount;i++){
+        if(fc.faceCull[i]==CULL_KEPT) binSetup(i);
+        else if(fc.faceCull[i]==CULL_CLIPPED){
+            for(int k=0,n=clipFace(fc,i,model,pieces);k<n;k++){
+                triangleSetups.push_back(pieces[k]);
+                binSetup(triangleSetups.size()-1);
+            }
+        }
+    }
+}
+
+inline void drawModelTiled(FrameContext &fc,const Model &model){
+    binTriangles(fc,model);
+
+    ProfileScope scope(STAGE_RASTER);
+    Framebuffer &fb = fc.framebuffer;
+    const std::vector<TriangleSetup> &triangleSetups = fc.triangleSetups;
+    int faceCount = model.faces.size();
+    int tilesX = TILES_X(fb);
+    RasterizeFn rasterize = deferredShading ? rasterizeVisibility : fc.kernel.rasterize;
+    parallelFor(tilesX*TILES_Y(fb), [&](int tile){
+        TraceScope tileScope("tile");
+        int x0 = (tile%tilesX)*TILE_SIZE, y0 = (tile/tilesX)*TILE_SIZE;
+        int x1 = std::min(fb.width,x0+TILE_SIZE)-1, y1 = std::min(fb.height,y0+TILE_SIZE)-1;
+
+        // Colors, or setup ids when deferred
+        uint32_t color[TILE_SIZE*TILE_SIZE];
+        float depth[TILE_SIZE*TILE_SIZE];
+        std::fill(color, color+TILE_SIZE*TILE_SIZE, deferredShading ? NO_SETUP : 0u);
+        std::fill(depth, depth+TILE_SIZE*TILE_SIZE, -1e10f);
+
+        const int blocks = (TILE_SIZE/8)*(TILE_SIZE/8);
+        float blockFar[blocks];
+        std::fill(blockFar, blockFar+blocks, -1e10f);
+        // Blocks wholly past the window edge are never drawn; at +inf they
+        // stay out of tileFar, so edge tiles are culled like interior ones
+        for(int b=0;b<blocks;b++)
+            if(x0+(b%(TILE_SIZE/8))*8>x1 || y0+(b/(TILE_SIZE/8))*8>y1) blockFar[b] = 1e30f;
+        float tileFar = -1e10f;
+
+        std::vector<int> &bin = fc.tileBins[tile];
+        if(hiZ && hiZSort)
+            std::stable_sort(bin.begin(), bin.end(), [&](int a,int b){ return triangleSetups[a].zNear>triangleSetups[b].zNear; });
+
+        for(int i : bin){
+            const TriangleSetup &t = triangleSetups[i];
+            if(hiZ && t.zNear<tileFar) continue;
+            if(!rasterize(t,model,color,depth,TILE_SIZE,x0,y0,x0,x1,y0,y1,
+                          hiZ ? blockFar : nullptr, i)) continue;
+            if(i<faceCount) fc.setupReached[i].store(true,std::memory_order_relaxed);
+            if(hiZ) tileFar = *std::min_element(blockFar, blockFar+blocks);
+        }
+
+        AlignedVector<uint32_t> &target = deferredShading ? fc.visibilityBuffer : fb.color;
+        for(int y=y0;y<=y1;y++){
+            size_t row = size_t(y)*fb.stride;
+            std::copy(color+(y-y0)*TILE_SIZE, color+(y-y0)*TILE_SIZE+(x1-x0+1), target.begin()+row+x0);
+            std::copy(depth+(y-y0)*TILE_SIZE, depth+(y-y0)*TILE_SIZE+(x1-x0+1), fb.depth.begin()+row+x0);
+        }
+    });
+
+    long occluded = 0;
+    for(int i=0;i<faceCount;i++)
+        occluded += fc.faceCull[i]==CULL_KEPT && !fc.setupReached[i].load(std::memory_order_relaxed);
+    fc.cullCounts[CULL_KEPT] -= occluded;
+    fc.cullCounts[CULL_OCCLUDED] += occluded;
+}
+
+// Moves the model's centre to the origin and fits fc's camera scale so the
+// whole model fills its framebuffer
+inline void centerModel(Model &model,FrameContext &fc){
+    glm::vec3 minV = model.boundsMin, maxV = model.boundsMax;
+    glm::vec3 center = (minV+maxV)*0.5f;
+    for(auto &v:model.vertices) v -= center;
+    model.boundsMin -= center;
+    model.boundsMax -= center;
+    for(Model &lod : model.lods){
+        for(auto &v : lod.vertices) v -= center;
+        lod.boundsMin -= center;
+        lod.boundsMax -= center;
+    }
+    shadowBVH = BVH(); // built from the old positions; draw() rebuilds it when needed
+    invalidateShadowCache();
+    shadowMap.valid = false;
+
+    glm::vec3 size = maxV-minV;
+    float scaleX = (fc.framebuffer.width-40)/size.x;
+    float scaleY = (fc.framebuffer.height-40)/size.y;
+    fc.camera.scale = std::min(scaleX,scaleY);
+}
+
+// Stacked bar of the last frame's stage times along the top of the window,
+// full width at 33 ms, with ticks at 16.7 and 33.3 ms. Only drawn on screen;
+// the framebuffer and the sinks never see it.
+inline void drawProfileOverlay(DrawingWindow &window,const Framebuffer &fb){
+    const ProfileStage stages[] = { STAGE_VERTICES, STAGE_SHADOW_CACHE, STAGE_SHADOW_MAP, STAGE_SETUP, STAGE_RASTER, STAGE_RESOLVE, STAGE_PRESENT, STAGE_SINK };
+    const uint32_t colors[] = { 0xFF4E79A7, 0xFFFF9DA7, 0xFFB07AA1, 0xFFF28E2B, 0xFFE15759, 0xFF76B7B2, 0xFF59A14F, 0xFFEDC948 };
+    const int top = 4, height = 8;
+    float pixelsPerMs = (fb.width-8)/33.3f;
+    float x = 4.0f;
+    for(int i=0;i<int(sizeof(stages)/sizeof(stages[0]));i++){
+        int x0 = int(x);
+        x += float(lastProfile.ms[stages[i]])*pixelsPerMs;
+        for(int px=x0; px<std::min(int(x),fb.width-4); px++)
+            for(int py=top; py<top+height && py<fb.height; py++)
+                window.setPixelColour(px,py,colors[i]);
+    }
+    for(float ms : {16.7f, 33.3f}){
+        int px = 4 + int(ms*pixelsPerMs);
+        for(int py=top-2; py<top+height+2 && px<fb.width && py<fb.height; py++)
+            window.setPixelColour(px,py,0xFFFFFFFF);
+    }
+}
+
+// Copies the finished frame into the window
+inline void presentFrame(DrawingWindow &window,const Framebuffer &fb){
+    ProfileScope scope(STAGE_PRESENT);
+    for(int y=0;y<fb.height;y++)
+        for(int x=0;x<fb.width;x++)
+            window.setPixelColour(x,y,fb.color[size_t(y)*fb.stride+x]);
+    if(profileOverlay) drawProfileOverlay(window,fb);
+}
+
+// Brings the shadow state every frame shares (BVH, per-face cache, shadow
+// map) up to date with the model and lightPos. draw() calls it first; once
+// it has run, further calls only read, so concurrent draws of the same
+// model are safe as long as one call came before them.
+inline void updateShadows(const Model &model){
+    if(shadingMode==SHADING_FLAT) return;
+    if(shadowMode==SHADOW_RAY){
+        if(shadowBVH.nodes.empty() && !model.faces.empty()) buildBVH(shadowBVH,model);
+        updateShadowCache(model,shadowBVH);
+    }
+    else
+        renderShadowMap(model);
+}
+
+// The coarsest LOD that still has a face for every LOD_PIXELS_PER_FACE
+// pixels of the model's on-screen extent (its bounding diagonal at the
+// camera scale, clipped to the framebuffer)
+#define LOD_PIXELS_PER_FACE 4.0f
+
+inline const Model& selectLOD(const FrameContext &fc,const Model &model){
+    if(!lodEnabled || model.lods.empty()) return model;
+    float extent = glm::length(model.boundsMax-model.boundsMin)*fc.camera.scale;
+    float pixels = std::min(extent, float(fc.framebuffer.width)) * std::min(extent, float(fc.framebuffer.height));
+    const Model* chosen = &model;
+    for(const Model &lod : model.lods){
+        if(lod.faces.size()*LOD_PIXELS_PER_FACE < pixels) break;
+        chosen = &lod;
+    }
+    return *chosen;
+}
+
+// Shadows always come from the full model; only what is rasterized drops
+// to a LOD
+inline void draw(FrameContext &fc,const Model &fullModel){
+    ProfileScope scope(STAGE_FRAME);
+    Framebuffer &fb = fc.framebuffer;
+    for(auto &c : fc.cullCounts) c = 0;
+    fc.kernel = selectShadingKernel(shadingMode, shadingMode!=SHADING_FLAT && shadowMode==SHADOW_MAP);
+    updateShadows(fullModel);
+    const Model &model = selectLOD(fc,fullModel);
+    processVertices(fc,model);
+    if(deferredShading) fc.visibilityBuffer.resize(fb.color.size());
+    if(tiledRaster)
+        drawModelTiled(fc,model); // every tile rewrites its own pixels, no clear needed
+    else{
+        std::fill(fb.color.begin(), fb.color.end(), 0u);
+        std::fill(fc.visibilityBuffer.begin(), fc.visibilityBuffer.end(), NO_SETUP);
+        std::fill(fb.depth.begin(), fb.depth.end(), -1e10f);
+        fc.blockFar.assign((fb.stride/8)*((fb.height+7)/8), -1e10f);
+        fc.triangleSetups.clear();
+        drawModel(fc,model);
+    }
+    if(deferredShading)
+        fc.kernel.resolve(fc,model);
+
+    profileCounts[COUNTER_TRIANGLES] += model.faces.size();
+    for(int r=CULL_DEGENERATE;r<CULL_RESULT_COUNT;r++) profileCounts[COUNTER_CULLED] += fc.cullCounts[r];
+    flushProfileCounters();
+}